@@ -1,6 +1,21 @@
 #include "stdlib.h"
 #include "adclient.h"
 
+// adaptive paged search aims at pages of about this size and latency
+#define AD_PAGE_TARGET_BYTES    (4 * 1024 * 1024)
+#define AD_PAGE_TARGET_LATENCY  1.0
+#define AD_MIN_PAGESIZE         50
+
+// DNs per (|(distinguishedName=...)...) filter in DNsToShortNames
+#define AD_DN_BATCH_SIZE        100
+
+// max seconds to cache "object not found" in getObjectDN
+#define AD_DN_CACHE_NEGATIVE_TTL 30
+
+// values changed by one modify request in groupAddUsers/groupRemoveUsers/syncGroupMembers,
+// keeps single request (and its transaction on DC) reasonably small
+#define AD_MAX_MODIFY_VALUES    5000
+
 /*
   Active Directory class.
 
@@ -16,12 +31,16 @@ adclient::adclient() {
   Constructor, to initialize default values of global variables.
 */
     ds = NULL;
+    dn_cache = &own_dn_cache;
+    pthread_mutex_init(&fastbind_mutex, NULL);
 }
 
 adclient::~adclient() {
 /*
   Destructor, to automaticaly free initial values allocated at login().
 */
+    fastbind_clear();
+    pthread_mutex_destroy(&fastbind_mutex);
     logout(ds);
 }
 
@@ -34,7 +53,16 @@ void adclient::logout(LDAP *ds) {
 void adclient::login(adConnParams _params) {
     ldap_prefix = _params.use_ldaps ? "ldaps" : "ldap";
 
+    // connections for checkUserPassword belong to previous login
+    fastbind_clear();
+    dn_cache_clear();
+    sid_cache.clear();
+
     if (!_params.uries.empty()) {
+        if ((_params.parallel_connect > 1) && (_params.uries.size() > 1)) {
+            login_parallel(_params);
+            return;
+        }
         for (vector <string>::iterator it = _params.uries.begin(); it != _params.uries.end(); ++it) {
             if (it->find("://") == string::npos) {
                 _params.uri = ldap_prefix + "://" + *it;
@@ -71,6 +99,150 @@ void adclient::login(adConnParams _params) {
     }
 }
 
+/*
+  State shared between login_parallel and its connecting threads.
+  It is freed by the last of them, so abandoned threads can finish on their own.
+*/
+struct parallel_login_state {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int refs;
+    int pending;
+    LDAP *winner;
+    adConnParams winner_params;
+    string error_msg;
+    int error_code;
+};
+
+struct parallel_login_attempt {
+    parallel_login_state *state;
+    adConnParams params;
+};
+
+static void parallel_login_release(parallel_login_state *state) {
+    pthread_mutex_lock(&state->mutex);
+    int refs = --state->refs;
+    pthread_mutex_unlock(&state->mutex);
+    if (refs == 0) {
+        pthread_cond_destroy(&state->cond);
+        pthread_mutex_destroy(&state->mutex);
+        delete state;
+    }
+}
+
+void *adclient::login_thread(void *arg) {
+/*
+  Connects and binds to one uri, first successfull connection wins,
+  connections completed after the winner are closed.
+*/
+    parallel_login_attempt *attempt = static_cast<parallel_login_attempt *>(arg);
+    parallel_login_state *state = attempt->state;
+
+    LDAP *ld = NULL;
+    bool success = false;
+    string error_msg;
+    int error_code = 0;
+    try {
+        login(&ld, attempt->params);
+        success = true;
+    }
+    catch (ADBindException& ex) {
+        error_msg = ex.msg;
+        error_code = ex.code;
+    }
+
+    pthread_mutex_lock(&state->mutex);
+    if (success && (state->winner == NULL)) {
+        state->winner = ld;
+        state->winner_params = attempt->params;
+        ld = NULL;
+    } else if (!success) {
+        state->error_msg = error_msg;
+        state->error_code = error_code;
+    }
+    state->pending--;
+    pthread_cond_signal(&state->cond);
+    pthread_mutex_unlock(&state->mutex);
+
+    logout(ld);
+    delete attempt;
+    parallel_login_release(state);
+    return NULL;
+}
+
+void adclient::login_parallel(adConnParams& _params) {
+/*
+  It connects and binds to _params.parallel_connect uries at once and keeps
+  the first successfull connection, others are abandoned.
+  If all of them fail, next uries are tried the same way.
+  It throws ADBindException with the last error if no connection succeeded.
+*/
+    string error_msg = "No suitable connection uries found";
+    int error_code = AD_PARAMS_ERROR;
+
+    size_t batch = _params.parallel_connect;
+    for (size_t first = 0; first < _params.uries.size(); first += batch) {
+        size_t last = std::min(first + batch, _params.uries.size());
+
+        parallel_login_state *state = new parallel_login_state();
+        pthread_mutex_init(&state->mutex, NULL);
+        pthread_cond_init(&state->cond, NULL);
+        state->refs = 1;
+        state->pending = 0;
+        state->winner = NULL;
+        state->error_code = 0;
+
+        pthread_mutex_lock(&state->mutex);
+        for (size_t i = first; i < last; ++i) {
+            parallel_login_attempt *attempt = new parallel_login_attempt();
+            attempt->state = state;
+            attempt->params = _params;
+            if (_params.uries[i].find("://") == string::npos) {
+                attempt->params.uri = ldap_prefix + "://" + _params.uries[i];
+            } else {
+                attempt->params.uri = _params.uries[i];
+            }
+
+            pthread_t thread;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&thread, &attr, login_thread, attempt) == 0) {
+                state->refs++;
+                state->pending++;
+            } else {
+                state->error_msg = "Failed to start connection thread for " + attempt->params.uri;
+                state->error_code = AD_SERVER_CONNECT_FAILURE;
+                delete attempt;
+            }
+            pthread_attr_destroy(&attr);
+        }
+
+        while ((state->winner == NULL) && (state->pending > 0)) {
+            pthread_cond_wait(&state->cond, &state->mutex);
+        }
+
+        LDAP *winner = state->winner;
+        if (winner != NULL) {
+            state->winner = NULL;
+            _params = state->winner_params;
+        } else if (!state->error_msg.empty()) {
+            error_msg = state->error_msg;
+            error_code = state->error_code;
+        }
+        pthread_mutex_unlock(&state->mutex);
+        parallel_login_release(state);
+
+        if (winner != NULL) {
+            logout(ds);
+            ds = winner;
+            params = _params;
+            return;
+        }
+    }
+    throw ADBindException(error_msg, error_code);
+}
+
 void adclient::login(vector <string> uries, string binddn, string bindpw, string search_base, bool secured) {
 /*
   Wrapper around login to support list of uries
@@ -97,15 +269,15 @@ void adclient::login(string _uri, string binddn, string bindpw, string search_ba
     login(_params);
 }
 
-void adclient::login(LDAP **ds, adConnParams& _params) {
+void adclient::connect(LDAP **ds, adConnParams& _params) {
 /*
-  To set various LDAP options and bind to LDAP server.
+  To set various LDAP options and connect to LDAP server (with StartTLS if requested).
   It set private pointer to LDAP connection identifier - ds.
   It returns nothing if operation was successfull, throws ADBindException otherwise.
 */
     logout(*ds);
 
-    int result, version, bindresult = -1;
+    int result, version;
 
     string error_msg;
 
@@ -182,18 +354,26 @@ void adclient::login(LDAP **ds, adConnParams& _params) {
     } else {
         _params.bind_method = _params.use_ldaps ? "LDAPS" : "plain";
     }
+}
+
+void adclient::login(LDAP **ds, adConnParams& _params) {
+/*
+  To connect and bind to LDAP server.
+  It set private pointer to LDAP connection identifier - ds.
+  It returns nothing if operation was successfull, throws ADBindException otherwise.
+*/
+    connect(ds, _params);
+
+    int bindresult = -1;
+    string error_msg;
 
     if (_params.secured) {
 #ifdef KRB5
         if (_params.use_gssapi) {
-            if (krb5_create_cache(_params.domain.c_str()) == 0) {
-                _params.login_method = "GSSAPI";
-                bindresult = sasl_bind_gssapi(*ds);
-                if (bindresult == LDAP_SUCCESS) {
-                    ldap_set_rebind_proc(*ds, sasl_rebind_gssapi, NULL);
-                }
-            } else {
-                bindresult = -1;
+            _params.login_method = "GSSAPI";
+            bindresult = krb5_bind_gssapi(*ds, _params.domain.c_str());
+            if (bindresult == LDAP_SUCCESS) {
+                ldap_set_rebind_proc(*ds, sasl_rebind_gssapi, NULL);
             }
         } else {
 #endif
@@ -214,12 +394,107 @@ void adclient::login(LDAP **ds, adConnParams& _params) {
     }
 }
 
+LDAP *adclient::fastbind_checkout(adConnParams &_params) {
+/*
+  It returns idle connection dedicated to checkUserPassword or opens a new one.
+  New connections are switched to AD fast bind mode (LDAP_SERVER_FAST_BIND_OID),
+  if server refuses it - plain simple re-binds are used on the same connection.
+  It throws ADBindException if connection can not be opened.
+*/
+    LDAP *ld = NULL;
+
+    pthread_mutex_lock(&fastbind_mutex);
+    if (!fastbind_pool.empty()) {
+        ld = fastbind_pool.back();
+        fastbind_pool.pop_back();
+    }
+    pthread_mutex_unlock(&fastbind_mutex);
+
+    if (ld != NULL) {
+        return ld;
+    }
+
+    try {
+        connect(&ld, _params);
+    }
+    catch (ADBindException&) {
+        logout(ld);
+        throw;
+    }
+
+    char *retoid = NULL;
+    struct berval *retdata = NULL;
+    ldap_extended_operation_s(ld, "1.2.840.113556.1.4.1781", NULL, NULL, NULL, &retoid, &retdata);
+    ldap_memfree(retoid);
+    ber_bvfree(retdata);
+
+    return ld;
+}
+
+void adclient::fastbind_checkin(LDAP *ld, size_t max_idle) {
+    pthread_mutex_lock(&fastbind_mutex);
+    if (fastbind_pool.size() < max_idle) {
+        fastbind_pool.push_back(ld);
+        ld = NULL;
+    }
+    pthread_mutex_unlock(&fastbind_mutex);
+    logout(ld);
+}
+
+void adclient::fastbind_clear() {
+    pthread_mutex_lock(&fastbind_mutex);
+    for (size_t i = 0; i < fastbind_pool.size(); ++i) {
+        logout(fastbind_pool[i]);
+    }
+    fastbind_pool.clear();
+    pthread_mutex_unlock(&fastbind_mutex);
+}
+
 bool adclient::checkUserPassword(string user, string password) {
 /*
   It returns true of false depends on user credentials correctness.
+  With params.fastbind_connections every check is a single simple bind on
+  one of dedicated long-lived connections. It is used only for unsecured
+  logins or when connection is encrypted (StartTLS/LDAPS), and can be
+  called concurrently.
 */
     LDAP *ld = NULL;
 
+    if ((params.fastbind_connections > 0) &&
+        (!params.secured || params.use_tls || params.use_ldaps)) {
+        // simple bind with empty password is an anonymous bind and always succeeds
+        if (password.empty()) {
+            return false;
+        }
+
+        // simple bind does not accept bare sAMAccountName
+        if ((user.find('@') == string::npos) &&
+            (user.find('\\') == string::npos) &&
+            (user.find('=') == string::npos)) {
+            string domain = params.domain.empty() ? dn2domain(params.search_base) : params.domain;
+            user = user + "@" + domain;
+        }
+
+        adConnParams _params(params);
+        // retry once on a fresh connection if idle one was closed by server
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            try {
+                ld = fastbind_checkout(_params);
+            }
+            catch (ADBindException&) {
+                return false;
+            }
+            int result = sasl_bind_simple(ld, user, password);
+            if (result >= 0) {
+                fastbind_checkin(ld, params.fastbind_connections);
+                return (result == LDAP_SUCCESS);
+            }
+            logout(ld);
+            ld = NULL;
+        }
+        return false;
+    }
+
     bool result = true;
     try {
         adConnParams _params(params);
@@ -235,213 +510,1598 @@ bool adclient::checkUserPassword(string user, string password) {
     return result;
 }
 
-map < string, map < string, vector<string> > > adclient::search(string OU, int scope, string filter, const vector <string> &attributes) {
+adAttributeList::adAttributeList() {
+    rebuild();
+}
+
+adAttributeList::adAttributeList(const vector <string> &_names) : attrnames(_names) {
+    rebuild();
+}
+
+adAttributeList::adAttributeList(const adAttributeList &other) : attrnames(other.attrnames) {
+    rebuild();
+}
+
+adAttributeList& adAttributeList::operator=(const adAttributeList &other) {
+    if (this != &other) {
+        attrnames = other.attrnames;
+        rebuild();
+    }
+    return *this;
+}
+
+void adAttributeList::assign(const vector <string> &_names) {
+    attrnames = _names;
+    rebuild();
+}
+
+void adAttributeList::push_back(const string &name) {
+    attrnames.push_back(name);
+    rebuild();
+}
+
+void adAttributeList::rebuild() {
+/*
+  It points ptrs to current names, strings are never copied.
+*/
+    ptrs.resize(attrnames.size() + 1);
+    for (size_t i = 0; i < attrnames.size(); ++i) {
+        ptrs[i] = const_cast<char *>(attrnames[i].c_str());
+    }
+    ptrs[attrnames.size()] = NULL;
+}
+
+void adSearchResult::clear() {
+    arena.clear();
+    entries.clear();
+    attrs.clear();
+    values.clear();
+    names.clear();
+    name_ids.clear();
+}
+
+void adSearchResult::begin_entry(const char *dn, size_t len) {
+    entry_rec rec;
+    rec.dn_off = arena.size();
+    rec.dn_len = len;
+    rec.attr_begin = attrs.size();
+    rec.attr_end = attrs.size();
+    arena.append(dn, len);
+    entries.push_back(rec);
+}
+
+void adSearchResult::add_attribute(const string &name) {
+/*
+  It starts new attribute of the last entry, name is interned.
+*/
+    map <string, unsigned int>::iterator it = name_ids.find(name);
+    if (it == name_ids.end()) {
+        it = name_ids.insert(std::make_pair(name, static_cast<unsigned int>(names.size()))).first;
+        names.push_back(name);
+    }
+    attr_rec rec;
+    rec.name_id = it->second;
+    rec.value_begin = values.size();
+    rec.value_end = values.size();
+    attrs.push_back(rec);
+    entries.back().attr_end = attrs.size();
+}
+
+void adSearchResult::add_value(const char *data, size_t len) {
+    value_rec rec;
+    rec.off = arena.size();
+    rec.len = len;
+    arena.append(data, len);
+    values.push_back(rec);
+    attrs.back().value_end = values.size();
+}
+
+void adSearchResult::abort_entry() {
+/*
+  It drops partially added last entry.
+*/
+    if (entries.empty()) return;
+    const entry_rec &rec = entries.back();
+    if (rec.attr_begin < attrs.size()) {
+        values.resize(attrs[rec.attr_begin].value_begin);
+    }
+    attrs.resize(rec.attr_begin);
+    arena.resize(rec.dn_off);
+    entries.pop_back();
+}
+
+adStringRef adSearchResult::dn(size_t entry) const {
+    const entry_rec &rec = entries.at(entry);
+    return adStringRef(arena.data() + rec.dn_off, rec.dn_len);
+}
+
+size_t adSearchResult::attribute_count(size_t entry) const {
+    const entry_rec &rec = entries.at(entry);
+    return rec.attr_end - rec.attr_begin;
+}
+
+const adSearchResult::attr_rec& adSearchResult::attr_at(size_t entry, size_t attribute) const {
+    const entry_rec &rec = entries.at(entry);
+    if (attribute >= rec.attr_end - rec.attr_begin) {
+        throw std::out_of_range("adSearchResult: attribute index out of range");
+    }
+    return attrs[rec.attr_begin + attribute];
+}
+
+const string& adSearchResult::attribute_name(size_t entry, size_t attribute) const {
+    return names[attr_at(entry, attribute).name_id];
+}
+
+int adSearchResult::find_attribute(size_t entry, const string &name) const {
+    map <string, unsigned int>::const_iterator id = name_ids.find(name);
+    if (id == name_ids.end()) return -1;
+    const entry_rec &rec = entries.at(entry);
+    for (size_t i = rec.attr_begin; i < rec.attr_end; ++i) {
+        if (attrs[i].name_id == id->second) return static_cast<int>(i - rec.attr_begin);
+    }
+    return -1;
+}
+
+size_t adSearchResult::value_count(size_t entry, size_t attribute) const {
+    const attr_rec &rec = attr_at(entry, attribute);
+    return rec.value_end - rec.value_begin;
+}
+
+adStringRef adSearchResult::value(size_t entry, size_t attribute, size_t value) const {
+    const attr_rec &rec = attr_at(entry, attribute);
+    if (value >= rec.value_end - rec.value_begin) {
+        throw std::out_of_range("adSearchResult: value index out of range");
+    }
+    const value_rec &val = values[rec.value_begin + value];
+    return adStringRef(arena.data() + val.off, val.len);
+}
+
+map < string, map < string, vector<string> > > adSearchResult::to_map() const {
+/*
+  It converts result to the type returned by adclient::search.
+*/
+    map < string, map < string, vector<string> > > result;
+    for (size_t e = 0; e < entries.size(); ++e) {
+        map < string, vector<string> > &entry = result[dn(e).str()];
+        for (size_t a = entries[e].attr_begin; a < entries[e].attr_end; ++a) {
+            vector<string> &vals = entry[names[attrs[a].name_id]];
+            vals.reserve(attrs[a].value_end - attrs[a].value_begin);
+            for (size_t v = attrs[a].value_begin; v < attrs[a].value_end; ++v) {
+                vals.push_back(string(arena.data() + values[v].off, values[v].len));
+            }
+        }
+    }
+    return result;
+}
+
+class adMessagePage {
+/*
+  Ref-counted owner of LDAP message with page of entries, shared by adEntryView's.
+*/
+public:
+      explicit adMessagePage(LDAPMessage *_msg) : msg(_msg), refs(1) {}
+
+      void acquire() { __sync_add_and_fetch(&refs, 1); }
+      void release() { if (__sync_sub_and_fetch(&refs, 1) == 0) delete this; }
+
+      // copies of DNs and values, when library can't return them in place
+      std::list <string> copies;
+
+private:
+      LDAPMessage *msg;
+      int refs;
+
+      ~adMessagePage() { ldap_msgfree(msg); }
+};
+
+adEntryView::adEntryView() : page(NULL) {
+}
+
+adEntryView::adEntryView(const adEntryView &other) :
+    page(other.page), dn_ref(other.dn_ref), names(other.names), offsets(other.offsets), vals(other.vals)
+{
+    if (page != NULL) page->acquire();
+}
+
+adEntryView& adEntryView::operator=(const adEntryView &other) {
+    if (this != &other) {
+        if (other.page != NULL) other.page->acquire();
+        reset(other.page);
+        dn_ref = other.dn_ref;
+        names = other.names;
+        offsets = other.offsets;
+        vals = other.vals;
+    }
+    return *this;
+}
+
+adEntryView::~adEntryView() {
+    if (page != NULL) page->release();
+}
+
+void adEntryView::reset(adMessagePage *_page) {
+/*
+  It drops current entry and pins '_page' (already acquired by caller).
+*/
+    if (page != NULL) page->release();
+    page = _page;
+    dn_ref = adStringRef();
+    names.clear();
+    offsets.clear();
+    vals.clear();
+}
+
+int adEntryView::find_attribute(const string &name) const {
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (names[i].size == name.size() && name.compare(0, name.size(), names[i].data, names[i].size) == 0) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+size_t adEntryView::value_count(size_t attribute) const {
+    if (attribute >= names.size()) {
+        throw std::out_of_range("adEntryView: attribute index out of range");
+    }
+    return offsets[attribute + 1] - offsets[attribute];
+}
+
+adStringRef adEntryView::value(size_t attribute, size_t value) const {
+    if (value >= value_count(attribute)) {
+        throw std::out_of_range("adEntryView: value index out of range");
+    }
+    return vals[offsets[attribute] + value];
+}
+
+map < string, vector<string> > adEntryView::to_map() const {
+/*
+  It copies entry to the type returned by adclient::_getvalues.
+*/
+    map < string, vector<string> > result;
+    for (size_t a = 0; a < names.size(); ++a) {
+        vector<string> &values = result[names[a].str()];
+        values.reserve(offsets[a + 1] - offsets[a]);
+        for (size_t v = offsets[a]; v < offsets[a + 1]; ++v) {
+            values.push_back(vals[v].str());
+        }
+    }
+    return result;
+}
+
+adSearchCursor::adSearchCursor(adclient &_ad, string _OU, int _scope, string _filter, const vector <string> &_attributes, int _pagesize, bool _escaped) :
+    ad(_ad), OU(_OU), scope(_scope), filter(_filter),
+    own_attrs(_attributes), attrs(&own_attrs),
+    cookie(NULL), page(NULL), holder(NULL), entry(NULL), msgid(-1), morepages(true),
+    pipelined(_ad.params.pipelined_search), returned(NULL), page_callback(NULL),
+    pagesize(_pagesize > 0 ? _pagesize : _ad.params.pagesize),
+    adaptive(_ad.params.adaptive_pagesize),
+    page_entries(0), page_bytes(0), entry_bytes(0), latency(0)
+{
+/*
+  Cursor over entries found with 'filter' in 'OU' with specified 'attributes'.
+  Pages are requested from server on demand, only current page is kept in memory.
+  '_pagesize' overrides adConnParams.pagesize if positive.
+  Backslashes of '_filter' are escaped, unless '_escaped' is set (values are
+  escaped by caller, see escape_filter_value).
+*/
+    init(_escaped);
+}
+
+adSearchCursor::adSearchCursor(adclient &_ad, string _OU, int _scope, string _filter, const adAttributeList &_attributes, int _pagesize, bool _escaped) :
+    ad(_ad), OU(_OU), scope(_scope), filter(_filter),
+    attrs(&_attributes),
+    cookie(NULL), page(NULL), holder(NULL), entry(NULL), msgid(-1), morepages(true),
+    pipelined(_ad.params.pipelined_search), returned(NULL), page_callback(NULL),
+    pagesize(_pagesize > 0 ? _pagesize : _ad.params.pagesize),
+    adaptive(_ad.params.adaptive_pagesize),
+    page_entries(0), page_bytes(0), entry_bytes(0), latency(0)
+{
+/*
+  Same as above, '_attributes' are used in place and must outlive the cursor.
+*/
+    init(_escaped);
+}
+
+void adSearchCursor::init(bool escaped) {
+    if (ad.ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+    if (pagesize <= 0) throw ADSearchException("Page size must be positive", AD_PARAMS_ERROR);
+    if (adaptive) {
+        pagesize = std::max(AD_MIN_PAGESIZE, std::min(pagesize, AD_MAX_ADAPTIVE_PAGESIZE));
+    }
+
+    if (!escaped) {
+        replace(filter, "\\", "\\\\");
+    }
+}
+
+adSearchCursor::~adSearchCursor() {
+    close();
+}
+
+void adSearchCursor::close() {
+/*
+  It releases current page and abandons outstanding page request,
+  cursor will not return entries any more.
+*/
+    if (msgid != -1) {
+        ldap_abandon_ext(ad.ds, msgid, NULL, NULL);
+        msgid = -1;
+    }
+    ldap_controls_free(returned);
+    returned = NULL;
+    release_page();
+    if (cookie != NULL) {
+        ber_bvfree(cookie);
+        cookie = NULL;
+    }
+    morepages = false;
+}
+
+void adSearchCursor::release_page() {
+/*
+  It frees current page, unless entry views still use it.
+*/
+    if (holder != NULL) {
+        holder->release();
+        holder = NULL;
+    } else if (page != NULL) {
+        ldap_msgfree(page);
+    }
+    page = NULL;
+    entry = NULL;
+}
+
+void adSearchCursor::adapt_pagesize() {
+/*
+  It resizes next page from observed entry size and page latency:
+  page should fit AD_PAGE_TARGET_BYTES and be served in about
+  AD_PAGE_TARGET_LATENCY seconds, within [AD_MIN_PAGESIZE, AD_MAX_ADAPTIVE_PAGESIZE].
+  Latency is not known in pipelined mode, page is sized by bytes only then.
+*/
+    if (entry_bytes == 0) return;
+
+    double size = static_cast<double>(AD_PAGE_TARGET_BYTES) / entry_bytes;
+    if (latency > 0) {
+        double by_latency = pagesize * AD_PAGE_TARGET_LATENCY / latency;
+        if (by_latency < size) size = by_latency;
+    }
+    // grow gradually, shrink at once
+    if (size > pagesize * 2.0) size = pagesize * 2.0;
+
+    if (size < AD_MIN_PAGESIZE) {
+        pagesize = AD_MIN_PAGESIZE;
+    } else if (size > AD_MAX_ADAPTIVE_PAGESIZE) {
+        pagesize = AD_MAX_ADAPTIVE_PAGESIZE;
+    } else {
+        pagesize = static_cast<int>(size);
+    }
+}
+
+void adSearchCursor::add_control(LDAPControl *control) {
+/*
+  It adds server control to page requests, must be called before first next().
+*/
+    controls.push_back(control);
+}
+
+void adSearchCursor::set_page_callback(adPageCallback *callback) {
+/*
+  It sets callback called after every received page, must be called before first next().
+*/
+    page_callback = callback;
+}
+
+LDAPControl *adSearchCursor::response_control(const char *oid) {
+    if (returned == NULL) return NULL;
+    return ldap_control_find(oid, returned, NULL);
+}
+
+void adSearchCursor::send_request() {
+/*
+  It sends asynchronous request for the page pointed by current cookie.
+  Throws ADSearchException on errors.
+*/
+    int result;
+    int attrsonly = 0;
+
+    int             iscritical = 1;
+
+    vector <LDAPControl *> serverctrls;
+    LDAPControl     *pagecontrol = NULL;
+
+    if (adaptive) {
+        adapt_pagesize();
+    }
+
+    result = ldap_create_page_control(ad.ds, pagesize, cookie, iscritical, &pagecontrol);
+    if (result != LDAP_SUCCESS) {
+        string error_msg = "Failed to create page control: ";
+        error_msg.append(ldap_err2string(result));
+        close();
+        throw ADSearchException(error_msg, result);
+    }
+    serverctrls.push_back(pagecontrol);
+    serverctrls.insert(serverctrls.end(), controls.begin(), controls.end());
+    serverctrls.push_back(NULL);
+
+    /* Search for entries in the directory using the parmeters.       */
+    result = ldap_search_ext(ad.ds, OU.c_str(), scope, filter.c_str(), attrs->c_array(), attrsonly, &serverctrls[0], NULL, NULL, LDAP_NO_LIMIT, &msgid);
+    ldap_control_free(pagecontrol);
+    if (result != LDAP_SUCCESS) {
+        msgid = -1;
+        string error_msg = "Error in paged ldap_search_ext: ";
+        error_msg.append(ldap_err2string(result));
+        close();
+        throw ADSearchException(error_msg, result);
+    }
+    gettimeofday(&sent, NULL);
+}
+
+bool adSearchCursor::fetch_page() {
+/*
+  It receives next page from server.
+  In pipelined mode request for the following page is sent before current
+  page is returned, so server prepares it while caller decodes entries.
+  It returns false if there are no more pages, throws ADSearchException on errors.
+*/
+    int result, errcodep;
+
+    string error_msg = "";
+
+    ber_int_t       totalcount;
+
+    LDAPControl     *pagecontrol = NULL;
+
+    release_page();
+
+    if (page_entries > 0) {
+        entry_bytes = page_bytes / page_entries;
+        page_entries = 0;
+        page_bytes = 0;
+    }
+
+    if (msgid == -1) {
+        if (!morepages) return false;
+        send_request();
+    }
+
+    // controls of previous page are kept until the next one is received
+    ldap_controls_free(returned);
+    returned = NULL;
+
+    do {
+        result = ldap_result(ad.ds, msgid, LDAP_MSG_ALL, NULL, &page);
+        if (result <= 0) {
+            if (result == 0) {
+                result = LDAP_TIMEOUT;
+            } else {
+                ldap_get_option(ad.ds, LDAP_OPT_RESULT_CODE, &result);
+            }
+            error_msg = "Error in paged ldap_result: ";
+            error_msg.append(ldap_err2string(result));
+            break;
+        }
+        msgid = -1;
+
+        // prefetched page waits for the caller, its latency includes caller's work
+        if (!pipelined) {
+            struct timeval received;
+            gettimeofday(&received, NULL);
+            latency = (received.tv_sec - sent.tv_sec) + (received.tv_usec - sent.tv_usec) / 1000000.0;
+        }
+
+        /* Parse the results to retrieve the contols being returned.      */
+        result = ldap_parse_result(ad.ds, page, &errcodep, NULL, NULL, NULL, &returned, false);
+        if (result != LDAP_SUCCESS) {
+            error_msg = "Failed to parse result: ";
+            error_msg.append(ldap_err2string(result));
+            break;
+        }
+        if ((errcodep != LDAP_SUCCESS) & (errcodep != LDAP_PARTIAL_RESULTS)) {
+            result = errcodep;
+            error_msg = "Error in paged search: ";
+            error_msg.append(ldap_err2string(result));
+            break;
+        }
+
+        /* Parse the page control returned to get the cookie and          */
+        /* determine whether there are more pages.                        */
+        pagecontrol = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, returned, NULL);
+        if (pagecontrol == NULL) {
+            error_msg = "Failed to find PAGEDRESULTS control";
+            result = 255;
+            break;
+        }
+
+        struct berval newcookie;
+        result = ldap_parse_pageresponse_control(ad.ds, pagecontrol, &totalcount, &newcookie);
+        pagecontrol = NULL;
+        if (result != LDAP_SUCCESS) {
+            error_msg = "Failed to parse pageresponse control: ";
+            error_msg.append(ldap_err2string(result));
+            break;
+        }
+        ber_bvfree(cookie);
+        cookie = reinterpret_cast<berval*>(ber_memalloc( sizeof( struct berval ) ));
+        if (cookie == NULL) {
+            ber_memfree(newcookie.bv_val);
+            error_msg = "Failed to allocate memory for cookie";
+            result = 255;
+            break;
+        }
+        *cookie = newcookie;
+
+        /* Determine if the cookie is not empty, indicating there are more pages for these search parameters. */
+        morepages = ((cookie->bv_val != NULL) && (cookie->bv_len > 0));
+    } while (false);
+
+    if (!error_msg.empty()) {
+        close();
+        throw ADSearchException(error_msg, result);
+    }
+
+    if (pipelined && morepages) {
+        send_request();
+    }
+
+    entry = ldap_first_entry(ad.ds, page);
+    if (page_callback != NULL) {
+        page_callback->page(*this);
+    }
+    return true;
+}
+
+LDAPMessage *adSearchCursor::next_entry() {
+/*
+  It returns next raw entry (owned by current page) or NULL if there are no more entries.
+*/
+    if (entry != NULL) {
+        entry = ldap_next_entry(ad.ds, entry);
+    }
+    while (entry == NULL) {
+        if (!fetch_page()) {
+            return NULL;
+        }
+        if (entry != NULL) {
+            return entry;
+        }
+    }
+    return entry;
+}
+
+bool adSearchCursor::next(string &dn, map < string, vector<string> > &values) {
+/*
+  It fills dn and values with next entry.
+  It returns false if there are no more entries.
+*/
+    LDAPMessage *current = next_entry();
+    if (current == NULL) {
+        return false;
+    }
+
+    char *cdn = ldap_get_dn(ad.ds, current);
+    if (cdn == NULL) {
+        throw ADSearchException("Error in ldap_get_dn", AD_LDAP_CONNECTION_ERROR);
+    }
+    dn = cdn;
+    ldap_memfree(cdn);
+
+    values = ad._getvalues(current);
+    ad._getranges(dn, values);
+
+    if (adaptive) {
+        size_t bytes = dn.size();
+        for (map < string, vector<string> >::const_iterator it = values.begin(); it != values.end(); ++it) {
+            bytes += it->first.size();
+            for (vector<string>::const_iterator val = it->second.begin(); val != it->second.end(); ++val) {
+                bytes += val->size();
+            }
+        }
+        page_bytes += bytes;
+        ++page_entries;
+    }
+    return true;
+}
+
+bool adSearchCursor::next(adSearchResult &result) {
+/*
+  It appends next entry to 'result' without intermediate containers.
+  It returns false if there are no more entries.
+*/
+    LDAPMessage *current = next_entry();
+    if (current == NULL) {
+        return false;
+    }
+
+    size_t before = result.bytes();
+    ad._appendvalues(current, result);
+
+    if (adaptive) {
+        page_bytes += result.bytes() - before;
+        ++page_entries;
+    }
+    return true;
+}
+
+bool adSearchCursor::next(adEntryView &view) {
+/*
+  It points 'view' to next entry, page stays in memory while view uses it.
+  It returns false if there are no more entries.
+*/
+    LDAPMessage *current = next_entry();
+    if (current == NULL) {
+        view.reset(NULL);
+        return false;
+    }
+
+    if (holder == NULL) {
+        holder = new adMessagePage(page);
+    }
+    holder->acquire();
+    view.reset(holder);
+    ad._getview(current, holder, view);
+
+    if (adaptive) {
+        size_t bytes = view.dn_ref.size;
+        for (size_t i = 0; i < view.vals.size(); ++i) {
+            bytes += view.vals[i].size;
+        }
+        page_bytes += bytes;
+        ++page_entries;
+    }
+    return true;
+}
+
+map < string, map < string, vector<string> > > adclient::search(string OU, int scope, string filter, const vector <string> &attributes) {
+/*
+  General search function.
+  It returns map with users found with 'filter' with specified 'attributes'.
+*/
+    return search(OU, scope, filter, attributes, 0);
+}
+
+map < string, map < string, vector<string> > > adclient::search(string OU, int scope, string filter, const vector <string> &attributes, int pagesize) {
+/*
+  General search function with explicit page size
+  (0 - adConnParams.pagesize).
+*/
+    return search(OU, scope, filter, adAttributeList(attributes), pagesize);
+}
+
+map < string, map < string, vector<string> > > adclient::search(string OU, int scope, string filter, const adAttributeList &attributes, int pagesize) {
+/*
+  General search function with prepared attribute list.
+*/
+    map < string, map < string, vector<string> > > search_result;
+
+    adSearchCursor cursor(*this, OU, scope, filter, attributes, pagesize);
+
+    string dn;
+    map < string, vector<string> > values;
+    while (cursor.next(dn, values)) {
+        search_result[dn].swap(values);
+    }
+
+    if (search_result.empty()) {
+        replace(filter, "\\", "\\\\");
+        throw ADSearchException(filter + " not found", AD_OBJECT_NOT_FOUND);
+    }
+    return search_result;
+}
+
+size_t adclient::search_stream(string OU, int scope, string filter, const vector <string> &attributes, adSearchCallback &callback, int pagesize) {
+/*
+  Streaming search function.
+  It passes entries found with 'filter' with specified 'attributes' to callback
+  as soon as their page is received, search stops when callback returns false.
+  It returns number of entries passed to callback.
+*/
+    return search_stream(OU, scope, filter, adAttributeList(attributes), callback, pagesize);
+}
+
+size_t adclient::search_stream(string OU, int scope, string filter, const adAttributeList &attributes, adSearchCallback &callback, int pagesize) {
+/*
+  Streaming search function with prepared attribute list.
+*/
+    adSearchCursor cursor(*this, OU, scope, filter, attributes, pagesize);
+
+    size_t count = 0;
+    string dn;
+    map < string, vector<string> > values;
+    while (cursor.next(dn, values)) {
+        ++count;
+        if (!callback.entry(dn, values)) {
+            break;
+        }
+    }
+    return count;
+}
+
+size_t adclient::search_columnar(string OU, int scope, string filter, const adAttributeList &attributes, adSearchResult &result, int pagesize) {
+/*
+  Search function filling columnar result.
+  It appends entries found with 'filter' with specified 'attributes' to
+  'result' and returns number of entries appended.
+*/
+    adSearchCursor cursor(*this, OU, scope, filter, attributes, pagesize);
+
+    size_t count = 0;
+    while (cursor.next(result)) {
+        ++count;
+    }
+    return count;
+}
+
+class asq_checker : public adPageCallback {
+/*
+  It throws ADSearchException if ASQ response control of a page reports an error
+  (asqResultCode is returned with every page).
+*/
+public:
+      const string &dn;
+      const string &attribute;
+
+      asq_checker(const string &_dn, const string &_attribute) : dn(_dn), attribute(_attribute) {}
+
+      void page(adSearchCursor &cursor) {
+          LDAPControl *response = cursor.response_control(AD_CONTROL_ASQ);
+          if (response == NULL) return;
+
+          ber_int_t code = LDAP_SUCCESS;
+          BerElement *ber = ber_init(&response->ldctl_value);
+          if (ber != NULL) {
+              if (ber_scanf(ber, "{e}", &code) == LBER_ERROR) {
+                  code = LDAP_SUCCESS;
+              }
+              ber_free(ber, 1);
+          }
+          if (code != LDAP_SUCCESS) {
+              string error_msg = "Error in attribute scoped query for " + attribute + " of " + dn + ": ";
+              error_msg.append(ldap_err2string(code));
+              throw ADSearchException(error_msg, code);
+          }
+      }
+};
+
+map < string, map < string, vector<string> > > adclient::search_asq(string dn, string attribute, string filter, const vector <string> &attributes) {
+/*
+  Attribute scoped query: it returns 'attributes' of objects found with 'filter'
+  among objects referenced by DN-valued 'attribute' of 'dn'
+  (e.g. all members of a group) in one paged search.
+  It throws ADSearchException with LDAP_AFFECTS_MULTIPLE_DSAS code if some of
+  referenced objects are not held by connected DC.
+*/
+    struct berval *value = NULL;
+    BerElement *ber = ber_alloc_t(LBER_USE_DER);
+    if (ber == NULL) {
+        throw ADSearchException("Failed to allocate memory for ASQ control", AD_PARAMS_ERROR);
+    }
+    if (ber_printf(ber, "{s}", attribute.c_str()) == -1 || ber_flatten(ber, &value) == -1) {
+        ber_free(ber, 1);
+        throw ADSearchException("Failed to encode ASQ control", AD_PARAMS_ERROR);
+    }
+    ber_free(ber, 1);
+
+    LDAPControl asq_control;
+    asq_control.ldctl_oid = const_cast<char *>(AD_CONTROL_ASQ);
+    asq_control.ldctl_value = *value;
+    asq_control.ldctl_iscritical = 1;
+
+    map < string, map < string, vector<string> > > search_result;
+    try {
+        asq_checker checker(dn, attribute);
+        adSearchCursor cursor(*this, dn, LDAP_SCOPE_BASE, filter, attributes);
+        cursor.add_control(&asq_control);
+        cursor.set_page_callback(&checker);
+
+        string entry_dn;
+        map < string, vector<string> > values;
+        while (cursor.next(entry_dn, values)) {
+            search_result[entry_dn].swap(values);
+        }
+    } catch (ADSearchException&) {
+        ber_bvfree(value);
+        throw;
+    }
+    ber_bvfree(value);
+
+    return search_result;
+}
+
+class search_collector : public adSearchCallback {
+/*
+  Collects streamed entries to the type returned by adclient::search.
+*/
+public:
+      map < string, map < string, vector<string> > > result;
+
+      bool entry(const string &dn, const map < string, vector<string> > &attributes) {
+          result[dn] = attributes;
+          return true;
+      }
+};
+
+map < string, map < string, vector<string> > > adclient::dirsync(string base, const vector <string> &attributes, string &cookie, string filter, int flags) {
+/*
+  It returns objects under naming context 'base' changed since 'cookie'
+  (empty cookie - all objects) and updates 'cookie' to the current state.
+*/
+    search_collector collector;
+    dirsync_stream(base, attributes, cookie, collector, filter, flags);
+    return collector.result;
+}
+
+size_t adclient::dirsync_stream(string base, const vector <string> &attributes, string &cookie, adSearchCallback &callback, string filter, int flags) {
+/*
+  DirSync search: it passes objects under naming context 'base' changed since
+  'cookie' to callback and returns number of objects passed.
+  'cookie' is opaque binary state, it is updated after every response the
+  callback consumed completely, so it can be persisted and passed again.
+  Deleted objects are returned with isDeleted attribute.
+  Without replicating directory changes right, AD_DIRSYNC_OBJECT_SECURITY flag is required.
+*/
+    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+
+    replace(filter, "\\", "\\\\");
+
+    adAttributeList attrs(attributes);
+
+    size_t count = 0;
+    ber_int_t more = 1;
+
+    while (more) {
+        int result, errcodep;
+        string error_msg = "";
+
+        LDAPMessage *res = NULL;
+        LDAPControl **returnedctrls = NULL;
+
+        struct berval request_cookie;
+        request_cookie.bv_val = const_cast<char *>(cookie.data());
+        request_cookie.bv_len = cookie.size();
+
+        struct berval *value = NULL;
+        BerElement *ber = ber_alloc_t(LBER_USE_DER);
+        if (ber == NULL) {
+            throw ADSearchException("Failed to allocate memory for DirSync control", AD_PARAMS_ERROR);
+        }
+        result = ber_printf(ber, "{iiO}", static_cast<ber_int_t>(flags), static_cast<ber_int_t>(INT_MAX), &request_cookie);
+        if (result == -1 || ber_flatten(ber, &value) == -1) {
+            ber_free(ber, 1);
+            throw ADSearchException("Failed to encode DirSync control", AD_PARAMS_ERROR);
+        }
+        ber_free(ber, 1);
+
+        LDAPControl dirsync_control;
+        dirsync_control.ldctl_oid = const_cast<char *>(AD_CONTROL_DIRSYNC);
+        dirsync_control.ldctl_value = *value;
+        dirsync_control.ldctl_iscritical = 1;
+        LDAPControl *serverctrls[2] = { &dirsync_control, NULL };
+
+        result = ldap_search_ext_s(ds, base.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(), attrs.c_array(), 0, serverctrls, NULL, NULL, LDAP_NO_LIMIT, &res);
+        ber_bvfree(value);
+
+        string new_cookie;
+        do {
+            if (result != LDAP_SUCCESS) {
+                error_msg = "Error in DirSync ldap_search_ext_s: ";
+                error_msg.append(ldap_err2string(result));
+                break;
+            }
+
+            result = ldap_parse_result(ds, res, &errcodep, NULL, NULL, NULL, &returnedctrls, false);
+            if (result != LDAP_SUCCESS) {
+                error_msg = "Failed to parse result: ";
+                error_msg.append(ldap_err2string(result));
+                break;
+            }
+
+            LDAPControl *response = ldap_control_find(AD_CONTROL_DIRSYNC, returnedctrls, NULL);
+            if (response == NULL) {
+                error_msg = "Failed to find DirSync control";
+                result = 255;
+                break;
+            }
+
+            ber_int_t unused;
+            struct berval server_cookie;
+            ber = ber_init(&response->ldctl_value);
+            if (ber == NULL) {
+                error_msg = "Failed to decode DirSync control";
+                result = 255;
+                break;
+            }
+            if (ber_scanf(ber, "{iio}", &more, &unused, &server_cookie) == LBER_ERROR) {
+                ber_free(ber, 1);
+                error_msg = "Failed to decode DirSync control";
+                result = 255;
+                break;
+            }
+            ber_free(ber, 1);
+            new_cookie = string(server_cookie.bv_val, server_cookie.bv_len);
+            ber_memfree(server_cookie.bv_val);
+        } while (false);
+
+        ldap_controls_free(returnedctrls);
+
+        if (!error_msg.empty()) {
+            ldap_msgfree(res);
+            throw ADSearchException(error_msg, result);
+        }
+
+        bool stopped = false;
+        try {
+            for (LDAPMessage *entry = ldap_first_entry(ds, res);
+                 entry != NULL;
+                 entry = ldap_next_entry(ds, entry)) {
+                char *dn = ldap_get_dn(ds, entry);
+                if (dn == NULL) {
+                    throw ADSearchException("Error in ldap_get_dn", AD_LDAP_CONNECTION_ERROR);
+                }
+                string entry_dn(dn);
+                ldap_memfree(dn);
+
+                ++count;
+                if (!callback.entry(entry_dn, _getvalues(entry))) {
+                    stopped = true;
+                    break;
+                }
+            }
+        } catch (...) {
+            ldap_msgfree(res);
+            throw;
+        }
+        ldap_msgfree(res);
+
+        if (stopped) break;
+        cookie = new_cookie;
+    }
+    return count;
+}
+
+adUSNWatermark adclient::usn_watermark() {
+/*
+  It returns current replication state of connected DC:
+  dnsHostName, invocationId and highestCommittedUSN.
+*/
+    vector <string> attributes;
+    attributes.push_back("dnsHostName");
+    attributes.push_back("dsServiceName");
+    attributes.push_back("highestCommittedUSN");
+
+    map < string, vector<string> > rootdse = _getbase("", attributes);
+
+    adUSNWatermark watermark;
+    try {
+        watermark.server = rootdse.at("dnsHostName").at(0);
+        watermark.usn = _stoll(rootdse.at("highestCommittedUSN").at(0));
+
+        // invocationId is stored in NTDS Settings object of DC
+        vector <string> ntds_attributes;
+        ntds_attributes.push_back("invocationId");
+        string invocation_id = _getbase(rootdse.at("dsServiceName").at(0), ntds_attributes).at("invocationId").at(0);
+
+        static const char hex[] = "0123456789abcdef";
+        for (size_t i = 0; i < invocation_id.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(invocation_id[i]);
+            watermark.invocation_id += hex[c >> 4];
+            watermark.invocation_id += hex[c & 0x0f];
+        }
+    }
+    catch (const std::invalid_argument& ex) {
+        throw ADSearchException("Wrong highestCommittedUSN of " + binded_uri() + ": " + ex.what(), AD_ATTRIBUTE_ENTRY_NOT_FOUND);
+    }
+    catch (const std::out_of_range&) {
+        // missing attribute or USN out of range
+        throw ADSearchException("Failed to get replication state of " + binded_uri(), AD_ATTRIBUTE_ENTRY_NOT_FOUND);
+    }
+    return watermark;
+}
+
+map < string, map < string, vector<string> > > adclient::search_changes(string OU, int scope, string filter, const vector <string> &attributes, adUSNWatermark &watermark) {
+/*
+  It returns objects found with 'filter' changed since 'watermark' and moves 'watermark'.
+*/
+    search_collector collector;
+    search_changes_stream(OU, scope, filter, attributes, watermark, collector);
+    return collector.result;
+}
+
+size_t adclient::search_changes_stream(string OU, int scope, string filter, const vector <string> &attributes, adUSNWatermark &watermark, adSearchCallback &callback) {
+/*
+  uSNChanged delta search, works without replication rights.
+  It passes objects found with 'filter' changed since 'watermark' to callback.
+  If connected DC has other invocationId (other DC or restored database),
+  all objects found with 'filter' are passed and watermark.full_sync is set.
+  'watermark' is moved to the state read before search only when callback
+  consumed all objects. Deleted objects are not returned.
+*/
+    adUSNWatermark current = usn_watermark();
+
+    current.full_sync = (watermark.invocation_id.empty() || (watermark.invocation_id != current.invocation_id));
+
+    string delta_filter = filter;
+    if (!current.full_sync) {
+        std::stringstream usn_filter;
+        usn_filter << "(&" << filter << "(uSNChanged>=" << (watermark.usn + 1) << "))";
+        delta_filter = usn_filter.str();
+    }
+
+    adSearchCursor cursor(*this, OU, scope, delta_filter, attributes);
+
+    size_t count = 0;
+    string dn;
+    map < string, vector<string> > values;
+    while (cursor.next(dn, values)) {
+        ++count;
+        if (!callback.entry(dn, values)) {
+            return count;
+        }
+    }
+
+    watermark = current;
+    return count;
+}
+
+map < string, vector<string> > adclient::_getbase(string dn, const vector <string> &attributes) {
+/*
+  Not paged base search, it returns attributes of 'dn' ("" - rootDSE).
+*/
+    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+
+    adAttributeList attrs(attributes);
+    LDAPMessage *res = NULL;
+
+    int result = ldap_search_ext_s(ds, dn.c_str(), LDAP_SCOPE_BASE, "(objectclass=*)", attrs.c_array(), 0, NULL, NULL, NULL, LDAP_NO_LIMIT, &res);
+    if (result != LDAP_SUCCESS) {
+        ldap_msgfree(res);
+        if (result == LDAP_NO_SUCH_OBJECT) {
+            throw ADSearchException(dn + " not found", AD_OBJECT_NOT_FOUND);
+        }
+        string error = "Error in ldap_search_ext_s for _getbase: ";
+        error.append(ldap_err2string(result));
+        throw ADSearchException(error, result);
+    }
+
+    map < string, vector<string> > values;
+    LDAPMessage *entry = ldap_first_entry(ds, res);
+    if (entry == NULL) {
+        ldap_msgfree(res);
+        throw ADSearchException(dn + " not found", AD_OBJECT_NOT_FOUND);
+    }
+    try {
+        values = _getvalues(entry);
+    } catch (ADSearchException&) {
+        ldap_msgfree(res);
+        throw;
+    }
+    ldap_msgfree(res);
+    return values;
+}
+
+bool adclient::ifDNExists(string dn) {
+/*
+  Wrapper around two arguments ifDNExists for searching any objectclass DN
+*/
+    return ifDNExists(dn, "*");
+}
+
+bool adclient::ifDNExists(string dn, string objectclass) {
+/*
+  It returns true of false depends on object DN existence.
+*/
+    vector <string> dns(1, dn);
+    return ifDNsExist(dns, objectclass)[0];
+}
+
+vector <bool> adclient::ifDNsExist(const vector <string> &dns, string objectclass) {
+/*
+  It returns existence of every DN in 'dns' (in the same order).
+  It throws ADSearchException on connection errors.
+*/
+    vector <string> found = _probeDNs(dns, objectclass);
+    vector <bool> exists(dns.size(), false);
+    for (size_t i = 0; i < found.size(); ++i) {
+        exists[i] = !found[i].empty();
+    }
+    return exists;
+}
+
+vector <string> adclient::_probeDNs(const vector <string> &dns, string objectclass) {
+/*
+  It returns DN of every object in 'dns' as stored on server (spacing and
+  escaping of 'dns' could differ), empty string if object does not exist.
+  Every DN is probed with base search limited to one entry, requests
+  are pipelined on connection (AD_DN_BATCH_SIZE at once).
+  It throws ADSearchException on connection errors.
+*/
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+    char *attrs[] = {"1.1", NULL};
+#pragma GCC diagnostic pop
+    int attrsonly = 1;
+
+    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+
+    string filter = "(objectclass=" + objectclass + ")";
+
+    vector <string> found(dns.size());
+
+    for (size_t chunk = 0; chunk < dns.size(); chunk += AD_DN_BATCH_SIZE) {
+        size_t chunk_end = std::min(dns.size(), chunk + AD_DN_BATCH_SIZE);
+
+        vector <int> msgids(chunk_end - chunk, -1);
+        string error_msg;
+        int result = LDAP_SUCCESS;
+
+        for (size_t i = chunk; i < chunk_end; ++i) {
+            result = ldap_search_ext(ds, dns[i].c_str(), LDAP_SCOPE_BASE, filter.c_str(), attrs, attrsonly, NULL, NULL, NULL, 1, &msgids[i - chunk]);
+            if (result == LDAP_SERVER_DOWN || result == LDAP_CONNECT_ERROR) {
+                error_msg = "Error in ldap_search_ext for _probeDNs: ";
+                error_msg.append(ldap_err2string(result));
+                break;
+            }
+            if (result != LDAP_SUCCESS) {
+                // e.g. DN syntax, such object can not exist
+                msgids[i - chunk] = -1;
+            }
+        }
+
+        for (size_t i = chunk; error_msg.empty() && (i < chunk_end); ++i) {
+            if (msgids[i - chunk] == -1) continue;
+
+            LDAPMessage *res = NULL;
+            result = ldap_result(ds, msgids[i - chunk], LDAP_MSG_ALL, NULL, &res);
+            msgids[i - chunk] = -1;
+            if (result <= 0) {
+                if (result == 0) {
+                    result = LDAP_TIMEOUT;
+                } else {
+                    ldap_get_option(ds, LDAP_OPT_RESULT_CODE, &result);
+                }
+                ldap_msgfree(res);
+                error_msg = "Error in ldap_result for _probeDNs: ";
+                error_msg.append(ldap_err2string(result));
+                break;
+            }
+            LDAPMessage *entry = ldap_first_entry(ds, res);
+            if (entry != NULL) {
+                char *dn = ldap_get_dn(ds, entry);
+                found[i] = (dn != NULL) ? dn : dns[i];
+                ldap_memfree(dn);
+            }
+            ldap_msgfree(res);
+        }
+
+        if (!error_msg.empty()) {
+            for (size_t i = 0; i < msgids.size(); ++i) {
+                if (msgids[i] != -1) ldap_abandon_ext(ds, msgids[i], NULL, NULL);
+            }
+            throw ADSearchException(error_msg, result);
+        }
+    }
+    return found;
+}
+
+vector <string> adclient::searchDN(string search_base, string filter, int scope) {
 /*
-  General search function.
-  It returns map with users found with 'filter' with specified 'attributes'.
+  It returns vector with DNs found with 'filter'.
 */
+    map < string, map < string, vector<string> > > search_result;
 
-    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
-
-    int result, errcodep;
-
-    char *attrs[50];
-    int attrsonly = 0;
+    vector <string> attributes;
+    attributes.push_back("1.1");
 
-    string error_msg = "";
+    search_result = search(search_base.c_str(), scope, filter, attributes);
 
-    ber_int_t       pagesize = 1000;
-    ber_int_t       totalcount;
-    struct berval   *cookie = NULL;
-    int             iscritical = 1;
+    vector <string> result;
 
-    LDAPControl     *serverctrls[2] = { NULL, NULL };
-    LDAPControl     *pagecontrol = NULL;
-    LDAPControl     **returnedctrls = NULL;
+    map < string, map < string, vector<string> > >::iterator res_it;
+    for ( res_it=search_result.begin() ; res_it != search_result.end(); ++res_it ) {
+        string dn = (*res_it).first;
+        result.push_back(dn);
+    }
 
-    LDAPMessage *res = NULL;
-    LDAPMessage *entry;
+    return result;
+}
 
-    char *dn;
+string escape_filter_value(const string &value) {
+/*
+  It escapes special characters of filter assertion value (RFC 4515),
+  such filters must be searched with adSearchCursor '_escaped' flag.
+*/
+    string result;
+    result.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i) {
+        switch (value[i]) {
+            case '\\': result += "\\5c"; break;
+            case '*':  result += "\\2a"; break;
+            case '(':  result += "\\28"; break;
+            case ')':  result += "\\29"; break;
+            case '\0': result += "\\00"; break;
+            default:   result += value[i];
+        }
+    }
+    return result;
+}
 
-    bool morepages;
+enum object_name_kind {
+    OBJECT_NAME_DN,
+    OBJECT_NAME_UPN,
+    OBJECT_NAME_SID,
+    OBJECT_NAME_GUID,
+    OBJECT_NAME_SHORT
+};
 
-    map < string, map < string, vector<string> > > search_result;
+static object_name_kind classify_object_name(const string &object) {
+/*
+  It guesses kind of object name without asking server.
+  '=' and ',' are not allowed in sAMAccountName, '@' is (so name
+  with '@' is either userPrincipalName or sAMAccountName).
+*/
+    if (object.find('=') != string::npos) {
+        return OBJECT_NAME_DN;
+    }
+    if (object.find('@') != string::npos) {
+        return OBJECT_NAME_UPN;
+    }
 
-    if (attributes.size() > 50) throw ADSearchException("Cant return more than 50 attributes", AD_PARAMS_ERROR);
+    // S-1-5-21-...
+    if ((object.size() > 4) && (upper(object.substr(0, 4)) == "S-1-")) {
+        size_t i = 4;
+        for (; i < object.size(); ++i) {
+            if (!isdigit(static_cast<unsigned char>(object[i])) && (object[i] != '-')) break;
+        }
+        if (i == object.size()) return OBJECT_NAME_SID;
+    }
 
-    unsigned int i;
-    for (i = 0; i < attributes.size(); ++i) {
-        attrs[i] = strdup(attributes[i].c_str());
+    // xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx, optionally in braces
+    string guid = object;
+    if ((guid.size() == 38) && (guid[0] == '{') && (guid[37] == '}')) {
+        guid = guid.substr(1, 36);
+    }
+    if (guid.size() == 36) {
+        size_t i = 0;
+        for (; i < guid.size(); ++i) {
+            if ((i == 8) || (i == 13) || (i == 18) || (i == 23)) {
+                if (guid[i] != '-') break;
+            } else if (!isxdigit(static_cast<unsigned char>(guid[i]))) {
+                break;
+            }
+        }
+        if (i == guid.size()) return OBJECT_NAME_GUID;
     }
-    attrs[i] = NULL;
 
-    replace(filter, "\\", "\\\\");
+    return OBJECT_NAME_SHORT;
+}
 
-    do {
-        result = ldap_create_page_control(ds, pagesize, cookie, iscritical, &pagecontrol);
-        if (result != LDAP_SUCCESS) {
-            error_msg = "Failed to create page control: ";
-            error_msg.append(ldap_err2string(result));
-            break;
+string adclient::getObjectDN(string object) {
+/*
+  It returns object DN by DN, userPrincipalName, objectSid (S-1-...),
+  objectGUID (xxxxxxxx-xxxx-...) or short name (sAMAccountName)
+  with one request.
+  Results are cached if adConnParams.dn_cache_size is set.
+*/
+    string dn;
+    if (dn_cache_get(object, dn)) {
+        if (dn.empty()) {
+            throw ADSearchException(object + " not found", AD_OBJECT_NOT_FOUND);
         }
-        serverctrls[0] = pagecontrol;
+        return dn;
+    }
 
-        /* Search for entries in the directory using the parmeters.       */
-        result = ldap_search_ext_s(ds, OU.c_str(), scope, filter.c_str(), attrs, attrsonly, serverctrls, NULL, NULL, LDAP_NO_LIMIT, &res);
-        if ((result != LDAP_SUCCESS) & (result != LDAP_PARTIAL_RESULTS)) {
-            error_msg = "Error in paged ldap_search_ext_s: ";
-            error_msg.append(ldap_err2string(result));
-            break;
+    try {
+        string name = object;
+        switch (classify_object_name(object)) {
+            case OBJECT_NAME_DN:
+                dn = _probeDNs(vector <string>(1, object), "*")[0];
+                if (dn.empty()) {
+                    throw ADSearchException(object + " not found", AD_OBJECT_NOT_FOUND);
+                }
+                break;
+            case OBJECT_NAME_SID:
+                dn = _getbasedn("<SID=" + object + ">");
+                break;
+            case OBJECT_NAME_GUID:
+                if (name[0] == '{') name = name.substr(1, 36);
+                dn = _getbasedn("<GUID=" + name + ">");
+                break;
+            case OBJECT_NAME_UPN:
+                dn = _searchUPN(object);
+                break;
+            case OBJECT_NAME_SHORT: {
+                adSearchCursor cursor(*this, params.search_base, LDAP_SCOPE_SUBTREE, "(sAMAccountName=" + escape_filter_value(object) + ")", vector <string>(1, "1.1"), 0, true);
+                map < string, vector<string> > values;
+                if (!cursor.next(dn, values)) {
+                    throw ADSearchException(object + " not found", AD_OBJECT_NOT_FOUND);
+                }
+                break;
+            }
         }
-        serverctrls[0] = NULL;
-        ldap_control_free(pagecontrol);
-        pagecontrol = NULL;
+    } catch (ADSearchException& ex) {
+        if (ex.code == AD_OBJECT_NOT_FOUND) {
+            dn_cache_put(object, "");
+        }
+        throw;
+    }
+    dn_cache_put(object, dn);
+    return dn;
+}
 
-        int num_results = ldap_count_entries(ds, res);
-        if (num_results == 0) {
-            error_msg = filter + " not found";
-            result = AD_OBJECT_NOT_FOUND;
-            break;
+string adclient::_searchUPN(const string &upn) {
+/*
+  It returns DN of object with userPrincipalName 'upn', or with such
+  sAMAccountName (e.g. 'user@domain' sAMAccountName of a contact).
+  Exact userPrincipalName match wins, otherwise name must match one object.
+  It throws ADSearchException with AD_OBJECT_AMBIGUOUS code if it matches several.
+*/
+    string value = escape_filter_value(upn);
+    adSearchCursor cursor(*this, params.search_base, LDAP_SCOPE_SUBTREE, "(|(userPrincipalName=" + value + ")(sAMAccountName=" + value + "))", vector <string>(1, "userPrincipalName"), 0, true);
+
+    string dn;
+    map < string, vector<string> > values;
+    vector <string> found;
+    while (cursor.next(dn, values)) {
+        map < string, vector<string> >::iterator name = values.find("userPrincipalName");
+        if ((name != values.end()) && !name->second.empty() && (upper(name->second[0]) == upper(upn))) {
+            return dn;
         }
+        found.push_back(dn);
+    }
 
-        map < string, vector<string> > valuesmap;
+    if (found.empty()) {
+        throw ADSearchException(upn + " not found", AD_OBJECT_NOT_FOUND);
+    }
+    if (found.size() > 1) {
+        throw ADSearchException(upn + " matches several objects", AD_OBJECT_AMBIGUOUS);
+    }
+    return found[0];
+}
 
-        for ( entry = ldap_first_entry(ds, res);
-              entry != NULL;
-              entry = ldap_next_entry(ds, entry) ) {
-            dn = ldap_get_dn(ds, entry);
-            valuesmap = _getvalues(entry);
-            search_result[dn] = valuesmap;
-            ldap_memfree(dn);
+map <string, string> adclient::_getObjectDNs(const vector <string> &objects, map <string, string> &errors) {
+/*
+  Batch getObjectDN: it returns DN for every found object name,
+  names which can not be found are stored to 'errors'.
+  DNs are probed with _probeDNs (server spelling of DN is returned), short names are searched with
+  (|(sAMAccountName=...)...) filters, other kinds - one by one.
+*/
+    map <string, string> result;
+    vector <string> dns;
+    vector <string> short_names;
+
+    for (size_t i = 0; i < objects.size(); ++i) {
+        const string &object = objects[i];
+        if (result.count(object) || errors.count(object)) continue;
+
+        string dn;
+        if (dn_cache_get(object, dn)) {
+            if (dn.empty()) {
+                errors[object] = object + " not found";
+            } else {
+                result[object] = dn;
+            }
+            continue;
         }
 
-        /* Parse the results to retrieve the contols being returned.      */
-        result = ldap_parse_result(ds, res, &errcodep, NULL, NULL, NULL, &returnedctrls, false);
-        if (result != LDAP_SUCCESS) {
-            error_msg = "Failed to parse result: ";
-            error_msg.append(ldap_err2string(result));
-            break;
+        switch (classify_object_name(object)) {
+            case OBJECT_NAME_DN:
+                result[object] = "";
+                dns.push_back(object);
+                break;
+            case OBJECT_NAME_SHORT:
+                result[object] = "";
+                short_names.push_back(object);
+                break;
+            default:
+                try {
+                    result[object] = getObjectDN(object);
+                } catch (ADSearchException& ex) {
+                    if ((ex.code != AD_OBJECT_NOT_FOUND) && (ex.code != AD_OBJECT_AMBIGUOUS)) throw;
+                    errors[object] = ex.msg;
+                }
         }
+    }
 
-        /* Parse the page control returned to get the cookie and          */
-        /* determine whether there are more pages.                        */
-        pagecontrol = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, returnedctrls, NULL);
-        if (pagecontrol == NULL) {
-            error_msg = "Failed to find PAGEDRESULTS control";
-            result = 255;
-            break;
+    if (!dns.empty()) {
+        vector <string> found = _probeDNs(dns, "*");
+        for (size_t i = 0; i < dns.size(); ++i) {
+            if (!found[i].empty()) {
+                result[dns[i]] = found[i];
+                dn_cache_put(dns[i], found[i]);
+            }
         }
+    }
 
-        struct berval newcookie;
-        result = ldap_parse_pageresponse_control(ds, pagecontrol, &totalcount, &newcookie);
-        if (result != LDAP_SUCCESS) {
-            error_msg = "Failed to parse pageresponse control: ";
-            error_msg.append(ldap_err2string(result));
-            break;
+    vector <string> attributes;
+    attributes.push_back("sAMAccountName");
+    adAttributeList attrs(attributes);
+
+    for (size_t chunk = 0; chunk < short_names.size(); chunk += AD_DN_BATCH_SIZE) {
+        size_t chunk_end = std::min(short_names.size(), chunk + AD_DN_BATCH_SIZE);
+
+        // upper(sAMAccountName) -> names as requested (may differ in case)
+        map < string, vector<string> > names;
+        string filter = "(|";
+        for (size_t i = chunk; i < chunk_end; ++i) {
+            string name = short_names[i];
+            names[upper(name)].push_back(name);
+            filter += "(sAMAccountName=" + escape_filter_value(name) + ")";
         }
-        ber_bvfree(cookie);
-        cookie = reinterpret_cast<berval*>(ber_memalloc( sizeof( struct berval ) ));
-        if (cookie == NULL) {
-            error_msg = "Failed to allocate memory for cookie";
-            result = 255;
-            break;
+        filter += ")";
+
+        adSearchCursor cursor(*this, params.search_base, LDAP_SCOPE_SUBTREE, filter, attrs, 0, true);
+        string dn;
+        map < string, vector<string> > values;
+        while (cursor.next(dn, values)) {
+            map < string, vector<string> >::iterator name = values.find("sAMAccountName");
+            if ((name == values.end()) || name->second.empty()) continue;
+
+            map < string, vector<string> >::iterator requested = names.find(upper(name->second[0]));
+            if (requested == names.end()) continue;
+            for (size_t i = 0; i < requested->second.size(); ++i) {
+                result[requested->second[i]] = dn;
+                dn_cache_put(requested->second[i], dn);
+            }
         }
-        *cookie = newcookie;
-
-        /* Cleanup the controls used. */
-        ldap_controls_free(returnedctrls);
-        returnedctrls = NULL;
+    }
 
-        /* Determine if the cookie is not empty, indicating there are more pages for these search parameters. */
-        if (cookie->bv_val != NULL && (strlen(cookie->bv_val) > 0)) {
-            morepages = true;
+    // not found DNs and short names
+    map <string, string>::iterator it = result.begin();
+    while (it != result.end()) {
+        if (it->second.empty()) {
+            errors[it->first] = it->first + " not found";
+            dn_cache_put(it->first, "");
+            result.erase(it++);
         } else {
-            morepages = false;
+            ++it;
         }
-
-        ldap_msgfree(res);
-    } while (morepages);
-
-    for (i = 0; i < attributes.size(); ++i) {
-        free(attrs[i]);
-    }
-
-    if (cookie != NULL) {
-        ber_bvfree(cookie);
-    }
-
-    if (error_msg.empty()) {
-        return search_result;
-    } else {
-        ldap_msgfree(res);
-        throw ADSearchException(error_msg, result);
     }
+    return result;
 }
 
-bool adclient::ifDNExists(string dn) {
+string adclient::_getbasedn(string base) {
 /*
-  Wrapper around two arguments ifDNExists for searching any objectclass DN
+  It returns real DN of object found by base search at 'base'
+  (e.g. '<SID=S-1-...>' or '<GUID=...>').
 */
-    return ifDNExists(dn, "*");
-}
+    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
 
-bool adclient::ifDNExists(string dn, string objectclass) {
-/*
-  It returns true of false depends on object DN existence.
-*/
-    int result;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wwrite-strings"
     char *attrs[] = {"1.1", NULL};
 #pragma GCC diagnostic pop
-    LDAPMessage *res;
-    string error_msg;
-    int attrsonly = 1;
+    LDAPMessage *res = NULL;
 
-    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+    int result = ldap_search_ext_s(ds, base.c_str(), LDAP_SCOPE_BASE, "(objectclass=*)", attrs, 1, NULL, NULL, NULL, 1, &res);
+    LDAPMessage *entry = (result == LDAP_SUCCESS) ? ldap_first_entry(ds, res) : NULL;
+    if (entry == NULL) {
+        ldap_msgfree(res);
+        if ((result == LDAP_SUCCESS) || (result == LDAP_NO_SUCH_OBJECT)) {
+            throw ADSearchException(base + " not found", AD_OBJECT_NOT_FOUND);
+        }
+        string error = "Error in ldap_search_ext_s for _getbasedn: ";
+        error.append(ldap_err2string(result));
+        throw ADSearchException(error, result);
+    }
 
-    string filter = "(objectclass=" + objectclass + ")";
-    result = ldap_search_ext_s(ds, dn.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(), attrs, attrsonly, NULL, NULL, NULL, LDAP_NO_LIMIT, &res);
+    char *cdn = ldap_get_dn(ds, entry);
+    if (cdn == NULL) {
+        ldap_msgfree(res);
+        throw ADSearchException("Error in ldap_get_dn", AD_LDAP_CONNECTION_ERROR);
+    }
+    string dn = cdn;
+    ldap_memfree(cdn);
     ldap_msgfree(res);
-
-    return (result == LDAP_SUCCESS);
+    return dn;
 }
 
-vector <string> adclient::searchDN(string search_base, string filter, int scope) {
+bool adclient::dn_cache_get(const string &object, string &dn) {
 /*
-  It returns vector with DNs found with 'filter'.
+  It returns true and cached DN (empty if object was not found) for object.
 */
-    map < string, map < string, vector<string> > > search_result;
+    if (params.dn_cache_size <= 0) return false;
+
+    bool found = false;
+    pthread_mutex_lock(&dn_cache->mutex);
+    std::map <string, std::list <dn_cache_entry>::iterator>::iterator it = dn_cache->index.find(upper(object));
+    if (it != dn_cache->index.end()) {
+        if (it->second->expires <= time(NULL)) {
+            dn_cache->entries.erase(it->second);
+            dn_cache->index.erase(it);
+        } else {
+            // most recently used first
+            dn_cache->entries.splice(dn_cache->entries.begin(), dn_cache->entries, it->second);
+            dn = it->second->dn;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&dn_cache->mutex);
+    return found;
+}
 
-    vector <string> attributes;
-    attributes.push_back("1.1");
+void adclient::dn_cache_put(const string &object, const string &dn) {
+    if (params.dn_cache_size <= 0) return;
 
-    search_result = search(search_base.c_str(), scope, filter, attributes);
+    string key = upper(object);
+    int ttl = dn.empty() ? std::min(params.dn_cache_ttl, AD_DN_CACHE_NEGATIVE_TTL) : params.dn_cache_ttl;
 
-    vector <string> result;
+    pthread_mutex_lock(&dn_cache->mutex);
 
-    map < string, map < string, vector<string> > >::iterator res_it;
-    for ( res_it=search_result.begin() ; res_it != search_result.end(); ++res_it ) {
-        string dn = (*res_it).first;
-        result.push_back(dn);
+    std::map <string, std::list <dn_cache_entry>::iterator>::iterator it = dn_cache->index.find(key);
+    if (it != dn_cache->index.end()) {
+        dn_cache->entries.erase(it->second);
+        dn_cache->index.erase(it);
     }
 
-    return result;
+    dn_cache_entry entry;
+    entry.key = key;
+    entry.dn = dn;
+    entry.expires = time(NULL) + ttl;
+    dn_cache->entries.push_front(entry);
+    dn_cache->index[key] = dn_cache->entries.begin();
+
+    while (dn_cache->entries.size() > static_cast<size_t>(params.dn_cache_size)) {
+        dn_cache->index.erase(dn_cache->entries.back().key);
+        dn_cache->entries.pop_back();
+    }
+    pthread_mutex_unlock(&dn_cache->mutex);
 }
 
-string adclient::getObjectDN(string object) {
+void adclient::dn_cache_invalidate(const string &dn) {
+/*
+  It drops cached resolutions to 'dn' and to objects under it
+  (after rename, move or delete), and all "not found" entries.
+*/
+    // group names could change
+    sid_cache.clear();
+
+    string udn = upper(dn);
+    string suffix = "," + udn;
+
+    pthread_mutex_lock(&dn_cache->mutex);
+    std::list <dn_cache_entry>::iterator it = dn_cache->entries.begin();
+    while (it != dn_cache->entries.end()) {
+        string cached = upper(it->dn);
+        if (cached.empty() || (cached == udn) || (it->key == udn) ||
+            ((cached.size() > suffix.size()) && (cached.compare(cached.size() - suffix.size(), suffix.size(), suffix) == 0))) {
+            dn_cache->index.erase(it->key);
+            it = dn_cache->entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    pthread_mutex_unlock(&dn_cache->mutex);
+}
+
+void adclient::dn_cache_clear(bool negative_only) {
 /*
-  It returns user DN by short name.
+  It drops all cached resolutions, or only "not found" ones (after object creation).
 */
-    if (ifDNExists(object)) {
-        return object;
+    pthread_mutex_lock(&dn_cache->mutex);
+    if (!negative_only) {
+        dn_cache->entries.clear();
+        dn_cache->index.clear();
     } else {
-        replace(object, "(", "\\(");
-        replace(object, ")", "\\)");
-        vector <string> dn = searchDN(params.search_base, "(sAMAccountName=" + object + ")", LDAP_SCOPE_SUBTREE);
-        return dn[0];
+        std::list <dn_cache_entry>::iterator it = dn_cache->entries.begin();
+        while (it != dn_cache->entries.end()) {
+            if (it->dn.empty()) {
+                dn_cache->index.erase(it->key);
+                it = dn_cache->entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
     }
+    pthread_mutex_unlock(&dn_cache->mutex);
+}
+
+static bool is_name_attribute(const string &attribute) {
+/*
+  It returns true for attributes objects are resolved by (see getObjectDN).
+*/
+    string name = upper(attribute);
+    return (name == "SAMACCOUNTNAME") || (name == "USERPRINCIPALNAME");
 }
 
 void adclient::mod_add(string object, string attribute, string value) {
@@ -478,6 +2138,9 @@ void adclient::mod_add(string object, string attribute, string value) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    if (is_name_attribute(attribute)) {
+        dn_cache_invalidate(dn);
+    }
 }
 
 void adclient::mod_delete(string object, string attribute, string value) {
@@ -520,6 +2183,9 @@ void adclient::mod_delete(string object, string attribute, string value) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    if (is_name_attribute(attribute)) {
+        dn_cache_invalidate(dn);
+    }
 }
 
 void adclient::mod_move(string object, string new_container) {
@@ -542,6 +2208,7 @@ void adclient::mod_move(string object, string new_container) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    dn_cache_invalidate(dn);
 }
 
 void adclient::mod_rename(string object, string cn) {
@@ -557,6 +2224,7 @@ void adclient::mod_rename(string object, string cn) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg,result);
     }
+    dn_cache_invalidate(dn);
 }
 
 void adclient::mod_replace(string object, string attribute, vector <string> list) {
@@ -595,6 +2263,9 @@ void adclient::mod_replace(string object, string attribute, vector <string> list
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    if (is_name_attribute(attribute)) {
+        dn_cache_invalidate(dn);
+    }
     for (i = 0; i < list.size(); ++i) {
         delete[] values[i];
     }
@@ -616,22 +2287,40 @@ void adclient::mod_replace(string object, string attribute, string value) {
 void adclient::CreateOU(string ou) {
 /*
   It creates given OU (with subOUs if needed).
+  Existence of OU and all its parents is checked at once.
   It returns nothing if operation was successfull, throw ADOperationalException - otherwise.
 */
-    if (ifDNExists(ou)) {
-        return;
+    vector < std::pair<string, string> > ou_exploded = explode_dn(ou);
+
+    // ou, its parent, ..., domain root
+    vector <string> chain;
+    for (size_t i = 0; i < ou_exploded.size(); ++i) {
+        vector < std::pair<string, string> > sub(ou_exploded.begin() + i, ou_exploded.end());
+        chain.push_back(merge_dn(sub));
+    }
+    if (chain.empty()) {
+        chain.push_back(ou);
     }
 
-    vector < std::pair<string, string> > ou_exploded = explode_dn(ou);
+    vector <bool> exists = ifDNsExist(chain);
 
-    std::pair<string, string> front_ou = ou_exploded.front();
-    ou_exploded.erase(ou_exploded.begin());
+    // deepest existing ancestor, everything below it is created
+    size_t top = 0;
+    while ((top < chain.size()) && !exists[top]) {
+        ++top;
+    }
 
-    string sub_ou = merge_dn(ou_exploded);
-    if ((!sub_ou.empty()) && (!ifDNExists(sub_ou))) {
-        CreateOU(sub_ou);
+    // create missing ones starting from the top
+    for (size_t i = top; i > 0; --i) {
+        std::pair<string, string> front_ou = (i - 1 < ou_exploded.size()) ? ou_exploded[i - 1] : std::make_pair(string(""), ou);
+        _addOU(chain[i - 1], front_ou);
     }
+}
 
+void adclient::_addOU(string ou, std::pair<string, string> front_ou) {
+/*
+  It creates single OU, its parent must exist.
+*/
     if (upper(front_ou.first) != "OU") {
         string error_msg = "Error in CreateOU, incorrect OU syntax: ";
         error_msg.append(front_ou.first + "=" + front_ou.second);
@@ -673,6 +2362,7 @@ void adclient::CreateOU(string ou) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    dn_cache_clear(true);
 }
 
 void adclient::DeleteDN(string dn) {
@@ -689,6 +2379,7 @@ void adclient::DeleteDN(string dn) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    dn_cache_invalidate(dn);
 }
 
 string adclient::dn2domain(string dn) {
@@ -794,7 +2485,8 @@ void adclient::CreateComputer(string name, string container) {
 
     if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
 
-    if (!ifDNExists(container)) CreateOU(container);
+    // it checks container and its parents at once
+    CreateOU(container);
 
     string dn = "CN=" + name + "," + container;
 
@@ -838,6 +2530,7 @@ void adclient::CreateComputer(string name, string container) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    dn_cache_clear(true);
 }
 
 void adclient::RenameDN(string object, string cn) {
@@ -883,7 +2576,8 @@ void adclient::CreateUser(string cn, string container, string user_short) {
 
     if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
 
-    if (!ifDNExists(container)) CreateOU(container);
+    // it checks container and its parents at once
+    CreateOU(container);
 
     string dn = "CN=" + cn + "," + container;
 
@@ -934,6 +2628,7 @@ void adclient::CreateUser(string cn, string container, string user_short) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    dn_cache_clear(true);
 }
 
 void adclient::CreateGroup(string cn, string container, string group_short) {
@@ -948,7 +2643,8 @@ void adclient::CreateGroup(string cn, string container, string group_short) {
     LDAPMod *attrs[4];
     LDAPMod attr1, attr2, attr3;
 
-    if (!ifDNExists(container)) CreateOU(container);
+    // it checks container and its parents at once
+    CreateOU(container);
 
     string dn = "CN=" + cn + "," + container;
 
@@ -989,6 +2685,7 @@ void adclient::CreateGroup(string cn, string container, string group_short) {
         error_msg.append(ldap_err2string(result));
         throw ADOperationalException(error_msg, result);
     }
+    dn_cache_clear(true);
 }
 
 struct berval adclient::password2berval(string password) {
@@ -1176,16 +2873,222 @@ void adclient::groupAddUser(string group, string user) {
     mod_add(group, "member", dn);
 }
 
-void adclient::groupRemoveUser(string group, string user) {
+void adclient::groupRemoveUser(string group, string user) {
+/*
+  Simple wrapper for mod_delete to perform LDAP_MOD_DELETE user operation only
+         on member attribure of group.
+*/
+    string dn = getObjectDN(user);
+
+    mod_delete(group, "member", dn);
+}
+
+map <string, string> adclient::groupAddUsers(string group, const vector <string> &users) {
+/*
+  It adds 'users' to 'group' with as few modify requests as possible.
+  It returns map of users which were not added with error description.
+*/
+    return _groupModifyMembers(group, users, LDAP_MOD_ADD);
+}
+
+map <string, string> adclient::groupRemoveUsers(string group, const vector <string> &users) {
+/*
+  It removes 'users' from 'group' with as few modify requests as possible.
+  It returns map of users which were not removed with error description.
+*/
+    return _groupModifyMembers(group, users, LDAP_MOD_DELETE);
+}
+
+map <string, string> adclient::_groupModifyMembers(string group, const vector <string> &members, int op) {
+/*
+  Members are resolved to DNs in batch and sent with _modify_members.
+*/
+    string group_dn = getObjectDN(group);
+
+    map <string, string> errors;
+    map <string, string> dns = _getObjectDNs(members, errors);
+
+    // member DNs in requested order without duplicates
+    vector <string> values;
+    vector <string> names;
+    std::set <string> seen;
+    for (size_t i = 0; i < members.size(); ++i) {
+        map <string, string>::iterator it = dns.find(members[i]);
+        if ((it == dns.end()) || !seen.insert(upper(it->second)).second) continue;
+        values.push_back(it->second);
+        names.push_back(it->first);
+    }
+
+    _modify_members(group_dn, op, values, names, errors);
+    return errors;
+}
+
+map <string, string> adclient::syncGroupMembers(string group, const vector <string> &members) {
+/*
+  It makes 'members' the only members of 'group': current members are read
+  (with ranged retrieval) and only the difference is added and removed.
+  It returns map of members which were not added (requested name) or
+  not removed (DN) with error description.
+  If any of 'members' can not be resolved nothing is removed: its current
+  value could be foreign or out of search_base DN, not the one to drop.
+  Adds are sent before removes, so group is never smaller than needed.
+  It throws ADOperationalException on connection errors.
+*/
+    string group_dn = getObjectDN(group);
+
+    map <string, string> errors;
+    map <string, string> dns = _getObjectDNs(members, errors);
+
+    vector <string> attributes;
+    attributes.push_back("member");
+    adSearchCursor cursor(*this, group_dn, LDAP_SCOPE_BASE, "(objectclass=*)", attributes);
+    string dn;
+    map < string, vector<string> > values;
+    if (!cursor.next(dn, values)) {
+        throw ADSearchException("Group " + group + " not found", AD_OBJECT_NOT_FOUND);
+    }
+    const vector <string> &current = values["member"];
+
+    std::set <string> current_keys;
+    for (size_t i = 0; i < current.size(); ++i) {
+        current_keys.insert(upper(current[i]));
+    }
+
+    std::set <string> desired_keys;
+    vector <string> add, add_names;
+    for (size_t i = 0; i < members.size(); ++i) {
+        map <string, string>::iterator it = dns.find(members[i]);
+        if (it == dns.end()) continue;
+        string key = upper(it->second);
+        if (!desired_keys.insert(key).second) continue;
+        if (!current_keys.count(key)) {
+            add.push_back(it->second);
+            add_names.push_back(it->first);
+        }
+    }
+
+    vector <string> remove;
+    if (errors.empty()) {
+        for (size_t i = 0; i < current.size(); ++i) {
+            if (!desired_keys.count(upper(current[i]))) {
+                remove.push_back(current[i]);
+            }
+        }
+    }
+
+    _modify_members(group_dn, LDAP_MOD_ADD, add, add_names, errors);
+    _modify_members(group_dn, LDAP_MOD_DELETE, remove, remove, errors);
+    return errors;
+}
+
+static bool is_value_error(int result) {
+/*
+  It returns true for modify results caused by some of the sent values
+  (missing or bad member DN, constraint violation), other values of the
+  same request may be fine.
+*/
+    switch (result) {
+        case LDAP_NO_SUCH_OBJECT:
+        case LDAP_CONSTRAINT_VIOLATION:
+        case LDAP_NO_SUCH_ATTRIBUTE:
+        case LDAP_TYPE_OR_VALUE_EXISTS:
+        case LDAP_ALREADY_EXISTS:
+        case LDAP_OBJECT_CLASS_VIOLATION:
+        case LDAP_INVALID_SYNTAX:
+        case LDAP_INVALID_DN_SYNTAX:
+        case LDAP_UNWILLING_TO_PERFORM:
+            return true;
+    }
+    return false;
+}
+
+void adclient::_modify_members(const string &group_dn, int op, const vector <string> &values, const vector <string> &names, map <string, string> &errors) {
+/*
+  It sends 'values' of member in modify requests of AD_MAX_MODIFY_VALUES values,
+  failed ones are stored to 'errors' under 'names'.
+  It throws ADOperationalException on connection errors.
+*/
+    for (size_t chunk = 0; chunk < values.size(); chunk += AD_MAX_MODIFY_VALUES) {
+        size_t chunk_end = std::min(values.size(), chunk + AD_MAX_MODIFY_VALUES);
+        int result = _modify_values(group_dn, op, "member", values, chunk, chunk_end);
+        if (result == LDAP_SUCCESS) continue;
+
+        // missing group gives the same result as missing member
+        if (result == LDAP_NO_SUCH_OBJECT && !ifDNExists(group_dn)) {
+            _modify_members_failed(result, names, chunk, chunk_end, errors);
+            continue;
+        }
+        _modify_members_range(group_dn, op, values, names, chunk, chunk_end, result, errors);
+    }
+}
+
+void adclient::_modify_members_range(const string &group_dn, int op, const vector <string> &values, const vector <string> &names, size_t first, size_t last, int result, map <string, string> &errors) {
+/*
+  It handles 'result' of modify of values[first..last). Modify is atomic and with
+  permissive modify control only real errors fail it. Range failed by a value-level
+  error is split in halves until failed values are found, any other error fails
+  the whole range.
+*/
+    if (result == LDAP_SUCCESS) return;
+
+    if (!is_value_error(result) || last - first == 1) {
+        _modify_members_failed(result, names, first, last, errors);
+        return;
+    }
+
+    size_t middle = first + (last - first) / 2;
+    _modify_members_range(group_dn, op, values, names, first, middle, _modify_values(group_dn, op, "member", values, first, middle), errors);
+    _modify_members_range(group_dn, op, values, names, middle, last, _modify_values(group_dn, op, "member", values, middle, last), errors);
+}
+
+void adclient::_modify_members_failed(int result, const vector <string> &names, size_t first, size_t last, map <string, string> &errors) {
+/*
+  It stores error of 'result' for names[first..last).
+  It throws ADOperationalException on connection errors.
+*/
+    if (result == LDAP_SERVER_DOWN || result == LDAP_CONNECT_ERROR) {
+        string error_msg = "Error in _modify_members, ldap_modify_ext_s: ";
+        error_msg.append(ldap_err2string(result));
+        throw ADOperationalException(error_msg, result);
+    }
+    string error = ldap_err2string(result);
+    for (size_t i = first; i < last; ++i) {
+        errors[names[i]] = error;
+    }
+}
+
+int adclient::_modify_values(const string &dn, int op, const string &attribute, const vector <string> &values, size_t first, size_t last) {
 /*
-  Simple wrapper for mod_delete to perform LDAP_MOD_DELETE user operation only
-         on member attribure of group.
+  It sends one modify of 'attribute' with values[first..last), returns LDAP result code.
+  Present values are not added again and absent ones are not removed (permissive modify).
 */
-    string dn = getObjectDN(user);
+    if (ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
 
-    mod_delete(group, "member", dn);
-}
+    vector <char*> list;
+    list.reserve(last - first + 1);
+    for (size_t i = first; i < last; ++i) {
+        list.push_back(const_cast<char*>(values[i].c_str()));
+    }
+    list.push_back(NULL);
+
+    LDAPMod attr;
+    attr.mod_op = op;
+    attr.mod_type = const_cast<char*>(attribute.c_str());
+    attr.mod_values = &list[0];
+
+    LDAPMod *attrs[2];
+    attrs[0] = &attr;
+    attrs[1] = NULL;
 
+    LDAPControl permissive_control;
+    permissive_control.ldctl_oid = const_cast<char *>(AD_CONTROL_PERMISSIVE_MODIFY);
+    permissive_control.ldctl_value.bv_val = NULL;
+    permissive_control.ldctl_value.bv_len = 0;
+    permissive_control.ldctl_iscritical = 0;
+    LDAPControl *serverctrls[2] = { &permissive_control, NULL };
+
+    return ldap_modify_ext_s(ds, dn.c_str(), attrs, serverctrls, NULL);
+}
 
 vector <string> adclient::getUserGroups(string user, bool nested) {
 /*
@@ -1193,7 +3096,17 @@ vector <string> adclient::getUserGroups(string user, bool nested) {
 */
     vector <string> groups;
 
-    if (nested) {
+    if (nested && params.use_tokengroups) {
+        // constructed attribute, available with base scope only
+        vector <string> attributes;
+        attributes.push_back("tokenGroups");
+        map < string, vector<string> > values = _getbase(getObjectDN(user), attributes);
+        map < string, vector<string> >::iterator sids = values.find("tokenGroups");
+        if (sids == values.end()) {
+            return vector<string>();
+        }
+        return _resolveSIDs(sids->second);
+    } else if (nested) {
         string dn = getObjectDN(user);
         try {
             groups = searchDN(params.search_base, "(&(objectclass=group)(member:1.2.840.113556.1.4.1941:=" + dn + "))", LDAP_SCOPE_SUBTREE);
@@ -1217,6 +3130,149 @@ vector <string> adclient::getUserGroups(string user, bool nested) {
     return DNsToShortNames(groups);
 }
 
+vector <bool> adclient::ifUsersInGroups(const vector < std::pair < string, vector <string> > > &questions) {
+/*
+  Batch nested membership check: for every (user, groups) question it returns
+  true if user is member of any of groups, directly or through nested groups.
+  Users and groups are resolved in batches (see _getObjectDNs), groups are
+  compared as interned ids (objectSid with adConnParams.use_tokengroups, DN otherwise).
+  Membership is read per user (tokenGroups or IN_CHAIN search), or per group with
+  batches of users if there are fewer groups than user batches.
+  Unknown users and groups never match.
+*/
+    vector <bool> result(questions.size(), false);
+
+    vector <string> users;
+    vector <string> groups;
+    for (size_t i = 0; i < questions.size(); ++i) {
+        users.push_back(questions[i].first);
+        groups.insert(groups.end(), questions[i].second.begin(), questions[i].second.end());
+    }
+
+    map <string, string> errors;
+    map <string, string> group_dns = _getObjectDNs(groups, errors);
+    if (group_dns.empty()) {
+        return result;
+    }
+
+    // upper(group DN) -> id
+    map <string, unsigned> group_ids;
+    // group name -> id
+    map <string, unsigned> wanted;
+    for (map <string, string>::iterator it = group_dns.begin(); it != group_dns.end(); ++it) {
+        map <string, unsigned>::iterator id = group_ids.find(upper(it->second));
+        if (id == group_ids.end()) {
+            id = group_ids.insert(std::make_pair(upper(it->second), static_cast<unsigned int>(group_ids.size()))).first;
+        }
+        wanted[it->first] = id->second;
+    }
+
+    // objectSid -> id
+    map <string, unsigned> sid_ids;
+    if (params.use_tokengroups) {
+        vector <string> attributes;
+        attributes.push_back("objectSid");
+        adAttributeList attrs(attributes);
+
+        map <string, unsigned>::iterator group = group_ids.begin();
+        while (group != group_ids.end()) {
+            string filter = "(|";
+            for (size_t n = 0; (n < AD_DN_BATCH_SIZE) && (group != group_ids.end()); ++n, ++group) {
+                filter += "(distinguishedName=" + escape_filter_value(group->first) + ")";
+            }
+            filter += ")";
+
+            adSearchCursor cursor(*this, params.search_base, LDAP_SCOPE_SUBTREE, filter, attrs, 0, true);
+            string dn;
+            map < string, vector<string> > values;
+            while (cursor.next(dn, values)) {
+                map <string, unsigned>::iterator id = group_ids.find(upper(dn));
+                if ((id != group_ids.end()) && !values["objectSid"].empty()) {
+                    sid_ids[values["objectSid"][0]] = id->second;
+                }
+            }
+        }
+    }
+
+    map <string, string> user_dns = _getObjectDNs(users, errors);
+    // upper(user DN) -> sorted ids of wanted groups user is member of
+    map < string, vector <unsigned> > user_groups;
+    for (map <string, string>::iterator it = user_dns.begin(); it != user_dns.end(); ++it) {
+        user_groups[upper(it->second)];
+    }
+
+    size_t user_batches = (user_groups.size() + AD_DN_BATCH_SIZE - 1) / AD_DN_BATCH_SIZE;
+    if (!params.use_tokengroups && (group_ids.size() * user_batches < user_groups.size())) {
+        for (map <string, unsigned>::iterator group = group_ids.begin(); group != group_ids.end(); ++group) {
+            map < string, vector <unsigned> >::iterator user = user_groups.begin();
+            while (user != user_groups.end()) {
+                string filter = "(&(memberOf:1.2.840.113556.1.4.1941:=" + escape_filter_value(group->first) + ")(|";
+                for (size_t n = 0; (n < AD_DN_BATCH_SIZE) && (user != user_groups.end()); ++n, ++user) {
+                    filter += "(distinguishedName=" + escape_filter_value(user->first) + ")";
+                }
+                filter += "))";
+
+                adSearchCursor cursor(*this, params.search_base, LDAP_SCOPE_SUBTREE, filter, vector <string>(1, "1.1"), 0, true);
+                string dn;
+                map < string, vector<string> > values;
+                while (cursor.next(dn, values)) {
+                    map < string, vector <unsigned> >::iterator member = user_groups.find(upper(dn));
+                    if (member != user_groups.end()) {
+                        member->second.push_back(group->second);
+                    }
+                }
+            }
+        }
+    } else {
+        vector <string> tokengroups_attribute;
+        tokengroups_attribute.push_back("tokenGroups");
+
+        for (map < string, vector <unsigned> >::iterator user = user_groups.begin(); user != user_groups.end(); ++user) {
+            try {
+                if (params.use_tokengroups) {
+                    vector <string> sids = _getbase(user->first, tokengroups_attribute)["tokenGroups"];
+                    for (size_t j = 0; j < sids.size(); ++j) {
+                        map <string, unsigned>::iterator id = sid_ids.find(sids[j]);
+                        if (id != sid_ids.end()) {
+                            user->second.push_back(id->second);
+                        }
+                    }
+                } else {
+                    vector <string> dns = searchDN(params.search_base, "(&(objectclass=group)(member:1.2.840.113556.1.4.1941:=" + user->first + "))", LDAP_SCOPE_SUBTREE);
+                    for (size_t j = 0; j < dns.size(); ++j) {
+                        map <string, unsigned>::iterator id = group_ids.find(upper(dns[j]));
+                        if (id != group_ids.end()) {
+                            user->second.push_back(id->second);
+                        }
+                    }
+                }
+            } catch (ADSearchException& ex) {
+                if (ex.code != AD_OBJECT_NOT_FOUND) throw;
+            }
+        }
+    }
+
+    for (map < string, vector <unsigned> >::iterator user = user_groups.begin(); user != user_groups.end(); ++user) {
+        std::sort(user->second.begin(), user->second.end());
+    }
+
+    for (size_t i = 0; i < questions.size(); ++i) {
+        map <string, string>::iterator dn = user_dns.find(questions[i].first);
+        if (dn == user_dns.end()) continue;
+        const vector <unsigned> &ids = user_groups[upper(dn->second)];
+
+        const vector <string> &names = questions[i].second;
+        for (size_t j = 0; j < names.size(); ++j) {
+            map <string, unsigned>::iterator group = wanted.find(names[j]);
+            if ((group != wanted.end()) && std::binary_search(ids.begin(), ids.end(), group->second)) {
+                result[i] = true;
+                break;
+            }
+        }
+    }
+    return result;
+}
+
 vector <string> adclient::getUsersInGroup(string group, bool nested) {
 /*
   It return vector of strings with members of Active Directory "group".
@@ -1235,9 +3291,32 @@ vector <string> adclient::getUsersInGroup(string group, bool nested) {
             throw;
         }
     } else {
+        // this will return not only users in group but groups in group too
+        string dn = getObjectDN(group);
+        try {
+            // sAMAccountName of all members in one paged search
+            vector <string> attributes;
+            attributes.push_back("sAMAccountName");
+            map < string, map < string, vector<string> > > members = search_asq(dn, "member", "(objectclass=*)", attributes);
+
+            vector <string> result;
+            for (map < string, map < string, vector<string> > >::iterator it = members.begin(); it != members.end(); ++it) {
+                map < string, vector<string> >::iterator name = it->second.find("sAMAccountName");
+                if ((name != it->second.end()) && !name->second.empty()) {
+                    result.push_back(name->second[0]);
+                } else {
+                    result.push_back(it->first);
+                }
+            }
+            return result;
+        } catch (ADSearchException& ex) {
+            // members from other domains, resolve one by one
+            if (ex.code != LDAP_AFFECTS_MULTIPLE_DSAS) {
+                throw;
+            }
+        }
         try {
-            // this will return not only users in group but groups in group too
-            users = getObjectAttribute(group, "member");
+            users = getObjectAttribute(dn, "member");
         } catch (ADSearchException& ex) {
             if (ex.code == AD_ATTRIBUTE_ENTRY_NOT_FOUND) {
                 return vector <string>();
@@ -1629,10 +3708,12 @@ AD can set following limit (http://support.microsoft.com/kb/315071/en-us):
    values that exceed the MaxValRange value. MaxValueRange controls the
    number of values that are returned on a single attribute on a single object.
 
-OpenLDAP does not support ranged controls for values:
-  https://www.mail-archive.com/openldap-its@openldap.org/msg00962.html
+Such attributes are returned as 'attribute;range=0-1499', the rest of values
+is requested by _getranges with 'attribute;range=1500-*' base searches and
+merged under plain 'attribute' name (search, search_stream, getObjectAttributes).
+adConnParams.range_parallelism sets number of ranges requested at once.
 
-So the only way is it increase MaxValRange in DC:
+Increasing MaxValRange in DC saves round trips for large groups:
  Ntdsutil.exe
    LDAP policies
      connections
@@ -1646,6 +3727,172 @@ So the only way is it increase MaxValRange in DC:
      q
    q
 */
+static bool parse_range(const string &key, string &attribute, unsigned int &low, unsigned int &high, bool &last) {
+/*
+  It splits 'member;range=0-1499' to 'member', 0, 1499;
+  last is true for 'member;range=1500-*'.
+*/
+    size_t pos = key.find(";range=");
+    if (pos == string::npos) return false;
+    attribute = key.substr(0, pos);
+
+    string range = key.substr(pos + 7);
+    size_t dash = range.find('-');
+    if (dash == string::npos) return false;
+
+    char *end;
+    low = strtoul(range.c_str(), &end, 10);
+    if (end != range.c_str() + dash) return false;
+    last = (range.compare(dash + 1, string::npos, "*") == 0);
+    if (last) {
+        high = 0;
+    } else {
+        high = strtoul(range.c_str() + dash + 1, &end, 10);
+        if (*end != '\0' || high < low) return false;
+    }
+    return true;
+}
+
+int adclient::_sendrange(const string &dn, const string &attribute, unsigned int low, unsigned int high) {
+/*
+  It requests values low..high (high == 0 - up to the end) of 'attribute' of 'dn'.
+  It returns message id for _recvrange.
+*/
+    std::stringstream name;
+    name << attribute << ";range=" << low << "-";
+    if (high == 0) {
+        name << "*";
+    } else {
+        name << high;
+    }
+    string attr = name.str();
+    char *attrs[] = {const_cast<char *>(attr.c_str()), NULL};
+
+    int msgid;
+    int result = ldap_search_ext(ds, dn.c_str(), LDAP_SCOPE_BASE, "(objectclass=*)", attrs, 0, NULL, NULL, NULL, LDAP_NO_LIMIT, &msgid);
+    if (result != LDAP_SUCCESS) {
+        string error = "Error in ldap_search_ext for _sendrange: ";
+        error.append(ldap_err2string(result));
+        throw ADSearchException(error, result);
+    }
+    return msgid;
+}
+
+bool adclient::_recvrange(int msgid, const string &attribute, vector<string> &values) {
+/*
+  It appends values of range requested by _sendrange to 'values'.
+  It returns true if it was the last range.
+*/
+    LDAPMessage *res = NULL;
+    int errcodep;
+
+    int result = ldap_result(ds, msgid, LDAP_MSG_ALL, NULL, &res);
+    if (result <= 0) {
+        if (result == 0) {
+            result = LDAP_TIMEOUT;
+        } else {
+            ldap_get_option(ds, LDAP_OPT_RESULT_CODE, &result);
+        }
+        ldap_msgfree(res);
+        string error = "Error in ldap_result for _recvrange: ";
+        error.append(ldap_err2string(result));
+        throw ADSearchException(error, result);
+    }
+
+    result = ldap_parse_result(ds, res, &errcodep, NULL, NULL, NULL, NULL, false);
+    if (result == LDAP_SUCCESS) result = errcodep;
+    if (result != LDAP_SUCCESS) {
+        ldap_msgfree(res);
+        string error = "Error in ranged search for " + attribute + ": ";
+        error.append(ldap_err2string(result));
+        throw ADSearchException(error, result);
+    }
+
+    bool last = true;
+    LDAPMessage *entry = ldap_first_entry(ds, res);
+    if (entry != NULL) {
+        map < string, vector<string> > range_values;
+        try {
+            range_values = _getvalues(entry);
+        } catch (ADSearchException&) {
+            ldap_msgfree(res);
+            throw;
+        }
+        for (map < string, vector<string> >::iterator it = range_values.begin(); it != range_values.end(); ++it) {
+            string name;
+            unsigned int low, high;
+            if (parse_range(it->first, name, low, high, last) && (name == attribute)) {
+                values.insert(values.end(), it->second.begin(), it->second.end());
+                break;
+            }
+        }
+    }
+    ldap_msgfree(res);
+    return last;
+}
+
+void adclient::_getranges(const string &dn, map < string, vector<string> > &values) {
+/*
+  It replaces 'attribute;range=0-N' values of entry with complete 'attribute'.
+*/
+    vector <string> ranged;
+    for (map < string, vector<string> >::iterator it = values.begin(); it != values.end(); ++it) {
+        if (it->first.find(";range=") != string::npos) {
+            ranged.push_back(it->first);
+        }
+    }
+
+    unsigned int parallel = params.range_parallelism > 1 ? params.range_parallelism : 1;
+
+    for (vector <string>::iterator key = ranged.begin(); key != ranged.end(); ++key) {
+        string attribute;
+        unsigned int low, high;
+        bool last;
+        if (!parse_range(*key, attribute, low, high, last)) continue;
+
+        vector<string> &result = values[attribute];
+        result.insert(result.end(), values[*key].begin(), values[*key].end());
+        values.erase(*key);
+
+        unsigned int step = high - low + 1;
+        unsigned int next = high + 1;
+        while (!last) {
+            if (parallel == 1) {
+                last = _recvrange(_sendrange(dn, attribute, next, 0), attribute, result);
+                next = low + result.size();
+                continue;
+            }
+
+            // explicit ranges of the same size, last one may stop early
+            vector <int> msgids;
+            try {
+                for (unsigned int i = 0; i < parallel; ++i) {
+                    msgids.push_back(_sendrange(dn, attribute, next + i * step, next + (i + 1) * step - 1));
+                }
+                size_t i = 0;
+                for (; i < msgids.size(); ++i) {
+                    last = _recvrange(msgids[i], attribute, result);
+                    if (last) break;
+                    // server returned less than asked - continue from the end
+                    if (i + 1 < msgids.size() && result.size() < (next + (i + 1) * step) - low) {
+                        last = false;
+                        break;
+                    }
+                }
+                for (++i; i < msgids.size(); ++i) {
+                    ldap_abandon_ext(ds, msgids[i], NULL, NULL);
+                }
+            } catch (ADSearchException&) {
+                for (size_t i = 0; i < msgids.size(); ++i) {
+                    ldap_abandon_ext(ds, msgids[i], NULL, NULL);
+                }
+                throw;
+            }
+            next = low + result.size();
+        }
+    }
+}
+
 map < string, vector<string> > adclient::_getvalues(LDAPMessage *entry) {
     if ((ds == NULL) || (entry == NULL)) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
 
@@ -1679,25 +3926,270 @@ map < string, vector<string> > adclient::_getvalues(LDAPMessage *entry) {
     return result;
 }
 
+void adclient::_appendvalues(LDAPMessage *entry, adSearchResult &result) {
+/*
+  Same as _getvalues, but DN and values are appended to columnar 'result'.
+*/
+    if ((ds == NULL) || (entry == NULL)) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+
+    char *dn = ldap_get_dn(ds, entry);
+    if (dn == NULL) {
+        throw ADSearchException("Error in ldap_get_dn", AD_LDAP_CONNECTION_ERROR);
+    }
+    result.begin_entry(dn, strlen(dn));
+    ldap_memfree(dn);
+
+    BerElement *berptr;
+
+    for ( char *next = ldap_first_attribute(ds, entry, &berptr);
+          next != NULL;
+          next = ldap_next_attribute(ds, entry, berptr) ) {
+        struct berval **values = ldap_get_values_len(ds, entry, next);
+        if (values == NULL) {
+            ldap_memfree(next);
+            ber_free(berptr, 0);
+            result.abort_entry();
+            string error = "Error in ldap_get_values_len for _appendvalues: no values found";
+            throw ADSearchException(error, AD_ATTRIBUTE_ENTRY_NOT_FOUND);
+        }
+        result.add_attribute(next);
+        for (unsigned int i = 0; values[i] != NULL; ++i) {
+            result.add_value(values[i]->bv_val, values[i]->bv_len);
+        }
+        ldap_memfree(next);
+        ldap_value_free_len(values);
+    }
+
+    ber_free(berptr, 0);
+}
+
+void adclient::_getview(LDAPMessage *entry, adMessagePage *page, adEntryView &view) {
+/*
+  It fills 'view' with entry, pinned 'page' must own entry.
+  With OpenLDAP DN, names and values point into the message itself,
+  other libraries return copies which are kept in 'page'.
+*/
+    if ((ds == NULL) || (entry == NULL)) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+
+    BerElement *berptr = NULL;
+#ifdef OPENLDAP
+    struct berval dn;
+    if (ldap_get_dn_ber(ds, entry, &berptr, &dn) != LDAP_SUCCESS) {
+        throw ADSearchException("Error in ldap_get_dn_ber", AD_LDAP_CONNECTION_ERROR);
+    }
+    view.dn_ref = adStringRef(dn.bv_val, dn.bv_len);
+
+    struct berval attr;
+    struct berval *values;
+    while (ldap_get_attribute_ber(ds, entry, berptr, &attr, &values) == LDAP_SUCCESS) {
+        if (attr.bv_val == NULL) break;
+        view.names.push_back(adStringRef(attr.bv_val, attr.bv_len));
+        view.offsets.push_back(view.vals.size());
+        if (values != NULL) {
+            for (unsigned int i = 0; values[i].bv_val != NULL; ++i) {
+                view.vals.push_back(adStringRef(values[i].bv_val, values[i].bv_len));
+            }
+            ber_memfree(values);
+        }
+    }
+#else
+    char *dn = ldap_get_dn(ds, entry);
+    if (dn == NULL) {
+        throw ADSearchException("Error in ldap_get_dn", AD_LDAP_CONNECTION_ERROR);
+    }
+    page->copies.push_back(dn);
+    ldap_memfree(dn);
+    view.dn_ref = adStringRef(page->copies.back().data(), page->copies.back().size());
+
+    for ( char *next = ldap_first_attribute(ds, entry, &berptr);
+          next != NULL;
+          next = ldap_next_attribute(ds, entry, berptr) ) {
+        page->copies.push_back(next);
+        ldap_memfree(next);
+        view.names.push_back(adStringRef(page->copies.back().data(), page->copies.back().size()));
+        view.offsets.push_back(view.vals.size());
+        struct berval **values = ldap_get_values_len(ds, entry, page->copies.back().c_str());
+        if (values == NULL) continue;
+        for (unsigned int i = 0; values[i] != NULL; ++i) {
+            page->copies.push_back(string(values[i]->bv_val, values[i]->bv_len));
+            view.vals.push_back(adStringRef(page->copies.back().data(), page->copies.back().size()));
+        }
+        ldap_value_free_len(values);
+    }
+#endif
+    view.offsets.push_back(view.vals.size());
+
+    ber_free(berptr, 0);
+}
+
+vector <string> adclient::_resolveSIDs(const vector <string> &sids) {
+/*
+  It returns sAMAccountName for every binary objectSid in 'sids' (in the same order),
+  or SID string if object can not be found.
+  Names are cached like DNs (adConnParams.dn_cache_size entries for
+  adConnParams.dn_cache_ttl seconds), unknown SIDs are resolved in
+  chunks with (|(objectSid=S-1-...)...) searches.
+*/
+    time_t now = time(NULL);
+    vector <string> result(sids.size());
+    bool cache = (params.dn_cache_size > 0);
+
+    map < string, vector <size_t> > missing;
+    for (size_t i = 0; i < sids.size(); ++i) {
+        map <string, sid_cache_entry>::iterator it = sid_cache.find(sids[i]);
+        if (cache && (it != sid_cache.end()) && (it->second.expires > now)) {
+            result[i] = it->second.name;
+        } else {
+            missing[decodeSID(sids[i])].push_back(i);
+        }
+    }
+
+    if (missing.empty()) {
+        return result;
+    }
+
+    if (sid_cache.size() + missing.size() > static_cast<size_t>(params.dn_cache_size)) {
+        sid_cache.clear();
+    }
+
+    vector <string> attributes;
+    attributes.push_back("objectSid");
+    attributes.push_back("sAMAccountName");
+    adAttributeList attrs(attributes);
+
+    map < string, vector <size_t> >::iterator chunk = missing.begin();
+    while (chunk != missing.end()) {
+        string filter = "(|";
+        for (size_t n = 0; (n < AD_DN_BATCH_SIZE) && (chunk != missing.end()); ++n, ++chunk) {
+            filter += "(objectSid=" + chunk->first + ")";
+        }
+        filter += ")";
+
+        adSearchCursor cursor(*this, params.search_base, LDAP_SCOPE_SUBTREE, filter, attrs);
+        string dn;
+        map < string, vector<string> > values;
+        while (cursor.next(dn, values)) {
+            map < string, vector<string> >::iterator sid = values.find("objectSid");
+            if ((sid == values.end()) || sid->second.empty()) continue;
+
+            map < string, vector<string> >::iterator name = values.find("sAMAccountName");
+            sid_cache_entry entry;
+            entry.name = ((name != values.end()) && !name->second.empty()) ? name->second[0] : dn;
+            entry.expires = now + params.dn_cache_ttl;
+            if (cache) {
+                sid_cache[sid->second[0]] = entry;
+            }
+
+            map < string, vector <size_t> >::iterator found = missing.find(decodeSID(sid->second[0]));
+            if (found == missing.end()) continue;
+            for (size_t i = 0; i < found->second.size(); ++i) {
+                result[found->second[i]] = entry.name;
+            }
+            found->second.clear();
+        }
+    }
+
+    // objects from other domains
+    for (map < string, vector <size_t> >::iterator it = missing.begin(); it != missing.end(); ++it) {
+        for (size_t i = 0; i < it->second.size(); ++i) {
+            result[it->second[i]] = it->first;
+        }
+    }
+    return result;
+}
+
+static string dn_domain_root(const string &dn) {
+/*
+  It returns 'DC=...' suffix of DN or empty string.
+*/
+    string udn = upper(dn);
+    for (size_t pos = udn.find("DC="); pos != string::npos; pos = udn.find("DC=", pos + 1)) {
+        if (pos == 0 || udn[pos - 1] == ',') {
+            return dn.substr(pos);
+        }
+    }
+    return "";
+}
+
 vector <string> adclient::DNsToShortNames(vector <string> &v) {
-    vector <string> result;
+/*
+  It returns sAMAccountName for every DN in 'v' (in the same order),
+  or DN itself if object has no sAMAccountName or can not be found.
+  DNs are resolved in chunks with (|(distinguishedName=...)...) searches
+  per domain root, DNs not found that way are resolved one by one.
+*/
+    vector <string> result(v.size());
+    vector <bool> resolved(v.size(), false);
+
+    map < string, vector <size_t> > roots;
+    for (size_t i = 0; i < v.size(); ++i) {
+        // can not be put into filter as is
+        if (v[i].find_first_of("()*") != string::npos) continue;
+
+        string root = dn_domain_root(v[i]);
+        roots[root.empty() ? params.search_base : root].push_back(i);
+    }
+
+    vector <string> attributes;
+    attributes.push_back("sAMAccountName");
+    adAttributeList attrs(attributes);
+
+    for (map < string, vector <size_t> >::iterator root = roots.begin(); root != roots.end(); ++root) {
+        const vector <size_t> &indexes = root->second;
+        try {
+            for (size_t chunk = 0; chunk < indexes.size(); chunk += AD_DN_BATCH_SIZE) {
+                size_t chunk_end = std::min(indexes.size(), chunk + AD_DN_BATCH_SIZE);
+
+                string filter = "(|";
+                map < string, vector <size_t> > wanted;
+                for (size_t i = chunk; i < chunk_end; ++i) {
+                    filter += "(distinguishedName=" + v[indexes[i]] + ")";
+                    wanted[upper(v[indexes[i]])].push_back(indexes[i]);
+                }
+                filter += ")";
+
+                adSearchCursor cursor(*this, root->first, LDAP_SCOPE_SUBTREE, filter, attrs);
+                string dn;
+                map < string, vector<string> > values;
+                while (cursor.next(dn, values)) {
+                    map < string, vector <size_t> >::iterator found = wanted.find(upper(dn));
+                    if (found == wanted.end()) continue;
+
+                    map < string, vector<string> >::iterator name = values.find("sAMAccountName");
+                    for (size_t i = 0; i < found->second.size(); ++i) {
+                        size_t index = found->second[i];
+                        if ((name != values.end()) && !name->second.empty()) {
+                            result[index] = name->second[0];
+                        } else {
+                            result[index] = v[index];
+                        }
+                        resolved[index] = true;
+                    }
+                }
+            }
+        }
+        catch (ADSearchException&) {
+            // e.g. domain root is not held by this DC, resolve one by one below
+        }
+    }
+
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (resolved[i]) continue;
 
-    vector <string>::iterator it;
-    for (it = v.begin(); it != v.end(); ++it) {
         vector <string> short_v;
         try {
-            short_v = getObjectAttribute(*it, "sAMAccountName");
+            short_v = getObjectAttribute(v[i], "sAMAccountName");
         }
         catch (ADSearchException& ex) {
             if (ex.code == AD_ATTRIBUTE_ENTRY_NOT_FOUND ||
                 // object could be not found if it is in a different search base / domain
                 ex.code == AD_OBJECT_NOT_FOUND) {
-                result.push_back(*it);
+                result[i] = v[i];
                 continue;
             }
             throw;
         }
-        result.push_back(short_v[0]);
+        result[i] = short_v[0];
     }
     return result;
 }
@@ -1712,12 +4204,12 @@ vector<string> adclient::get_ldap_servers(string domain, string site) {
     if (!site.empty()) {
         string srv_site = "_ldap._tcp." + site + "._sites." + domain;
         try {
-            servers = perform_srv_query(srv_site);
+            servers = resolve_srv(srv_site);
         } catch (ADBindException &ex) { }
     }
 
     string srv_default = "_ldap._tcp." + domain;
-    vector<string> servers_default = perform_srv_query(srv_default);
+    vector<string> servers_default = resolve_srv(srv_default);
 
     // extend site DCs list with all DCs list (except already added site DCs) in case when site DCs is unavailable
     for (vector <string>::iterator it = servers_default.begin(); it != servers_default.end(); ++it) {
@@ -1729,23 +4221,121 @@ vector<string> adclient::get_ldap_servers(string domain, string site) {
     return servers;
 }
 
+map<string, adclient::srv_cache_entry> adclient::srv_cache;
+pthread_mutex_t adclient::srv_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+unsigned int adclient::srv_seed = 0;
+
+bool adclient::srv_priority_less(const srv_record &a, const srv_record &b) {
+    return a.priority < b.priority;
+}
+
+vector<string> adclient::resolve_srv(string srv_rec) {
+/*
+  It returns hosts from SRV records for srv_rec ordered according to RFC 2782:
+  by priority, and by weighted random choice within the same priority.
+  Records are cached process-wide until their DNS TTL expires.
+*/
+    vector<srv_record> records;
+    time_t now = time(0);
+
+    pthread_mutex_lock(&srv_cache_mutex);
+    map<string, srv_cache_entry>::iterator it = srv_cache.find(srv_rec);
+    if ((it != srv_cache.end()) && (it->second.expires > now)) {
+        records = it->second.records;
+    }
+    pthread_mutex_unlock(&srv_cache_mutex);
+
+    if (records.empty()) {
+        records = perform_srv_query(srv_rec);
+
+        srv_cache_entry entry;
+        entry.records = records;
+        int ttl = 0;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if ((i == 0) || (records[i].ttl < ttl)) {
+                ttl = records[i].ttl;
+            }
+        }
+        entry.expires = now + ttl;
+
+        pthread_mutex_lock(&srv_cache_mutex);
+        srv_cache[srv_rec] = entry;
+        pthread_mutex_unlock(&srv_cache_mutex);
+    }
+
+    std::stable_sort(records.begin(), records.end(), srv_priority_less);
+
+    pthread_mutex_lock(&srv_cache_mutex);
+    if (srv_seed == 0) {
+        srv_seed = now ^ getpid();
+    }
+
+    vector<string> hosts;
+    size_t group_start = 0;
+    while (group_start < records.size()) {
+        size_t group_end = group_start;
+        while ((group_end < records.size()) && (records[group_end].priority == records[group_start].priority)) {
+            ++group_end;
+        }
+
+        // zero weight records go first, so they have a small chance to be selected
+        vector<srv_record> group;
+        for (size_t i = group_start; i < group_end; ++i) {
+            if (records[i].weight == 0) group.push_back(records[i]);
+        }
+        for (size_t i = group_start; i < group_end; ++i) {
+            if (records[i].weight != 0) group.push_back(records[i]);
+        }
+
+        while (!group.empty()) {
+            long sum = 0;
+            for (size_t i = 0; i < group.size(); ++i) {
+                sum += group[i].weight;
+            }
+            long choice = rand_r(&srv_seed) % (sum + 1);
+            size_t selected = group.size() - 1;
+            long running = 0;
+            for (size_t i = 0; i < group.size(); ++i) {
+                running += group[i].weight;
+                if (running >= choice) {
+                    selected = i;
+                    break;
+                }
+            }
+            if (find(hosts.begin(), hosts.end(), group[selected].host) == hosts.end()) {
+                hosts.push_back(group[selected].host);
+            }
+            group.erase(group.begin() + selected);
+        }
+
+        group_start = group_end;
+    }
+    pthread_mutex_unlock(&srv_cache_mutex);
+
+    return hosts;
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunknown-pragmas"
 #pragma GCC diagnostic ignored "-Wunused-but-set-variable"
 // this magic was copy pasted and adopted from
 // https://www.ccnx.org/releases/latest/doc/ccode/html/ccndc-srv_8c_source.html
-vector<string> adclient::perform_srv_query(string srv_rec) {
+vector<adclient::srv_record> adclient::perform_srv_query(string srv_rec) {
     union dns_ans {
              HEADER header;
              unsigned char buf[NS_MAXMSG];
           } ans;
-    size_t ans_size;
+    int ans_size;
 
     char *srv_name = strdup(srv_rec.c_str());
     if (!srv_name) {
         throw ADBindException("Failed to allocate memory for srv_rec", AD_LDAP_RESOLV_ERROR);
     }
     ans_size = res_search(srv_name, ns_c_in, ns_t_srv, ans.buf, sizeof(ans.buf));
+    if (ans_size < 0) {
+        free(srv_name);
+        throw ADBindException("Error while resolving ldap server for " + srv_rec + ": res_search failed", AD_LDAP_RESOLV_ERROR);
+    }
 
     int qdcount, ancount;
     qdcount = ntohs(ans.header.qdcount);
@@ -1768,7 +4358,7 @@ vector<string> adclient::perform_srv_query(string srv_rec) {
     unsigned char *end;
     char host[NS_MAXDNAME];
 
-    vector<string> ret;
+    vector<srv_record> ret;
     for (i = ancount; i > 0; --i) {
         size = dn_expand(ans.buf, msgend, msg, srv_name, strlen(srv_name)+1);
         if (size < 0) {
@@ -1800,7 +4390,13 @@ vector<string> adclient::perform_srv_query(string srv_rec) {
             throw ADBindException("Error while resolving ldap server for " + srv_rec + ": dn_expand(host) < 0", AD_LDAP_RESOLV_ERROR);
         }
         // std::cout << priority << " " << weight << " " << ttl << " " << host << ":" << port << std::endl;
-        ret.push_back(string(host));
+        srv_record record;
+        record.host = host;
+        record.port = port;
+        record.priority = priority;
+        record.weight = weight;
+        record.ttl = ttl;
+        ret.push_back(record);
         msg = end;
     }
     free(srv_name);
@@ -22,6 +22,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <set>
 #include <sstream>
 #include <iostream>
 #include <iterator>     // std::distance
@@ -33,6 +35,8 @@
 #include <cerrno>
 #include <cstdlib>
 #include <resolv.h>
+#include <pthread.h>
+#include <unistd.h>
 
 // for OS X
 #ifndef NS_MAXMSG
@@ -48,9 +52,32 @@
 #define AD_ATTRIBUTE_ENTRY_NOT_FOUND    10
 #define AD_OU_SYNTAX_ERROR              12
 #define AD_LDAP_RESOLV_ERROR            14
+#define AD_OBJECT_AMBIGUOUS             16
 
 #define MAX_PASSWORD_LENGTH 22
 
+// default MaxPageSize of AD LDAP policy
+#define AD_MAX_PAGESIZE 1000
+// upper bound of adaptive page size, DC returns at most its MaxPageSize
+// entries per page, so policy must be raised to get bigger pages
+#define AD_MAX_ADAPTIVE_PAGESIZE 5000
+
+// LDAP_SERVER_DIRSYNC_OID and its flags
+#define AD_CONTROL_DIRSYNC                  "1.2.840.113556.1.4.841"
+#define AD_DIRSYNC_OBJECT_SECURITY          0x00000001
+#define AD_DIRSYNC_ANCESTORS_FIRST_ORDER    0x00000800
+#define AD_DIRSYNC_PUBLIC_DATA_ONLY         0x00002000
+#define AD_DIRSYNC_INCREMENTAL_VALUES       0x80000000
+
+// LDAP_SERVER_ASQ_OID (attribute scoped query)
+#define AD_CONTROL_ASQ                      "1.2.840.113556.1.4.1504"
+
+// LDAP_SERVER_NOTIFICATION_OID
+#define AD_CONTROL_NOTIFICATION             "1.2.840.113556.1.4.528"
+
+// LDAP_SERVER_PERMISSIVE_MODIFY_OID (adding present or removing absent value is not an error)
+#define AD_CONTROL_PERMISSIVE_MODIFY        "1.2.840.113556.1.4.1413"
+
 #define AD_SCOPE_BASE         LDAP_SCOPE_BASE
 #define AD_SCOPE_BASEOBJECT   LDAP_SCOPE_BASEOBJECT
 #define AD_SCOPE_ONELEVEL     LDAP_SCOPE_ONELEVEL
@@ -78,6 +105,11 @@ struct krb_struct {
     krb5_context context;
     char *mem_cache_env;
     krb5_ccache cc;
+    // principal, realm and lifetime of credentials stored in cc
+    krb5_principal principal;
+    string domain;
+    krb5_timestamp endtime;
+    krb5_timestamp renew_till;
 };
 #endif
 
@@ -121,13 +153,50 @@ struct adConnParams {
         // LDAP_OPT_TIMELIMIT
         int timelimit;
 
+        // number of uries to connect and bind simultaneously (0 or 1 - one by one)
+        int parallel_connect;
+
+        // number of dedicated connections kept for checkUserPassword
+        // (0 - new connection for every check)
+        int fastbind_connections;
+
+        // request next page of paged search before current page is processed
+        bool pipelined_search;
+
+        // entries per page of paged search
+        int pagesize;
+        // resize pages from observed entry size and latency (up to AD_MAX_ADAPTIVE_PAGESIZE)
+        bool adaptive_pagesize;
+
+        // number of value ranges of large multi-valued attributes
+        // (e.g. member;range=1500-2999) requested at once (0 or 1 - one by one)
+        int range_parallelism;
+
+        // number of object name -> DN resolutions cached by getObjectDN (0 - no cache)
+        int dn_cache_size;
+        // seconds to keep cached DN
+        int dn_cache_ttl;
+
+        // getUserGroups(user, true) reads tokenGroups (security groups only,
+        // including primary group) instead of LDAP_MATCHING_RULE_IN_CHAIN search
+        bool use_tokengroups;
+
         adConnParams() :
             secured(true),
             use_gssapi(false),
             use_tls(false),
             use_ldaps(false),
             // by default do not touch timeouts
-            nettimeout(-1), timelimit(-1)
+            nettimeout(-1), timelimit(-1),
+            parallel_connect(0),
+            fastbind_connections(0),
+            pipelined_search(false),
+            pagesize(AD_MAX_PAGESIZE),
+            adaptive_pagesize(false),
+            range_parallelism(0),
+            dn_cache_size(0),
+            dn_cache_ttl(300),
+            use_tokengroups(false)
         {};
 
         friend class adclient;
@@ -139,7 +208,255 @@ struct adConnParams {
 };
 
 
+class adAttributeList {
+/*
+  Attribute names prepared for ldap search calls: NULL-terminated
+  char* array pointing into own strings, without size limit.
+  Can be built once and reused across searches.
+*/
+public:
+      adAttributeList();
+      explicit adAttributeList(const std::vector <string> &_names);
+      adAttributeList(const adAttributeList &other);
+      adAttributeList& operator=(const adAttributeList &other);
+
+      void assign(const std::vector <string> &_names);
+      void push_back(const string &name);
+
+      const std::vector <string>& names() const { return attrnames; }
+      size_t size() const { return attrnames.size(); }
+      char **c_array() const { return const_cast<char **>(&ptrs[0]); }
+
+private:
+      std::vector <string> attrnames;
+      std::vector <char *> ptrs;
+
+      void rebuild();
+};
+
+struct adStringRef {
+/*
+  Unowned view of bytes stored in adSearchResult.
+*/
+      const char *data;
+      size_t size;
+
+      adStringRef() : data(NULL), size(0) {}
+      adStringRef(const char *_data, size_t _size) : data(_data), size(_size) {}
+      string str() const { return string(data, size); }
+};
+
+class adSearchResult {
+/*
+  Columnar search result: DNs and values of all entries are stored in one
+  arena, entries/attributes/values are offset tables into it, attribute
+  names are interned once per result.
+  adStringRef views stay valid until result is modified.
+*/
+public:
+      adSearchResult() {}
+
+      size_t size() const { return entries.size(); }
+      bool empty() const { return entries.empty(); }
+      void clear();
+
+      adStringRef dn(size_t entry) const;
+      size_t attribute_count(size_t entry) const;
+      const string& attribute_name(size_t entry, size_t attribute) const;
+      // index of attribute in entry or -1
+      int find_attribute(size_t entry, const string &name) const;
+      size_t value_count(size_t entry, size_t attribute) const;
+      adStringRef value(size_t entry, size_t attribute, size_t value) const;
+
+      std::map < string, std::map < string, std::vector<string> > > to_map() const;
+
+      // bytes of DNs and values stored
+      size_t bytes() const { return arena.size(); }
+
+      friend class adclient;
+
+private:
+      struct entry_rec {
+          size_t dn_off;
+          size_t dn_len;
+          size_t attr_begin;
+          size_t attr_end;
+      };
+      struct attr_rec {
+          unsigned int name_id;
+          size_t value_begin;
+          size_t value_end;
+      };
+      struct value_rec {
+          size_t off;
+          size_t len;
+      };
+
+      string arena;
+      std::vector <entry_rec> entries;
+      std::vector <attr_rec> attrs;
+      std::vector <value_rec> values;
+      std::vector <string> names;
+      std::map <string, unsigned int> name_ids;
+
+      const attr_rec& attr_at(size_t entry, size_t attribute) const;
+
+      void begin_entry(const char *dn, size_t len);
+      void add_attribute(const string &name);
+      void add_value(const char *data, size_t len);
+      void abort_entry();
+};
+
+class adMessagePage;
+
+class adEntryView {
+/*
+  Entry of paged search without copying: DN, attribute names and values
+  point into LDAP message of the page, which is kept alive (ref-counted)
+  while any view of its entries exists.
+  Views can be copied and passed between threads.
+*/
+public:
+      adEntryView();
+      adEntryView(const adEntryView &other);
+      adEntryView& operator=(const adEntryView &other);
+      ~adEntryView();
+
+      bool empty() const { return page == NULL; }
+      adStringRef dn() const { return dn_ref; }
+      size_t attribute_count() const { return names.size(); }
+      adStringRef attribute_name(size_t attribute) const { return names.at(attribute); }
+      // index of attribute or -1
+      int find_attribute(const string &name) const;
+      size_t value_count(size_t attribute) const;
+      adStringRef value(size_t attribute, size_t value) const;
+
+      std::map < string, std::vector<string> > to_map() const;
+
+      friend class adclient;
+      friend class adSearchCursor;
+
+private:
+      adMessagePage *page;
+      adStringRef dn_ref;
+      std::vector <adStringRef> names;
+      // values of attribute i are vals[offsets[i]..offsets[i+1])
+      std::vector <size_t> offsets;
+      std::vector <adStringRef> vals;
+
+      void reset(adMessagePage *_page);
+};
+
+struct adUSNWatermark {
+/*
+  Replication state of DC for adclient::search_changes.
+  Default (empty) watermark makes full sync.
+*/
+      // dnsHostName of DC
+      string server;
+      // invocationId of DC database (hex), USNs are valid only for the same invocationId
+      string invocation_id;
+      // highestCommittedUSN seen on DC
+      long long usn;
+      // set by search_changes: true if last call returned all objects
+      bool full_sync;
+
+      adUSNWatermark() : usn(0), full_sync(false) {}
+};
+
+class adSearchCallback {
+/*
+  Receives entries found by adclient::search_stream one by one.
+  Search stops when entry() returns false.
+*/
+public:
+      virtual ~adSearchCallback() {}
+      virtual bool entry(const string &dn, const std::map < string, std::vector<string> > &attributes) = 0;
+};
+
+class adclient;
+class adSearchCursor;
+
+class adPageCallback {
+/*
+  Called by adSearchCursor for every received page (empty ones too),
+  e.g. to check response controls. Exception thrown by page() stops the search.
+*/
+public:
+      virtual ~adPageCallback() {}
+      virtual void page(adSearchCursor &cursor) = 0;
+};
+
+class adSearchCursor {
+/*
+  Iterator form of paged search, only current page is kept in memory:
+    adSearchCursor cursor(ad, OU, scope, filter, attributes);
+    while (cursor.next(dn, attributes)) { ... }
+  Cursor must not outlive adclient it was created with.
+*/
+public:
+      adSearchCursor(adclient &_ad, string _OU, int _scope, string _filter, const std::vector <string> &_attributes, int _pagesize = 0, bool _escaped = false);
+      adSearchCursor(adclient &_ad, string _OU, int _scope, string _filter, const adAttributeList &_attributes, int _pagesize = 0, bool _escaped = false);
+      ~adSearchCursor();
+
+      bool next(string &dn, std::map < string, std::vector<string> > &values);
+      // appends next entry to 'result'
+      bool next(adSearchResult &result);
+      // view of next entry, valid after cursor moves on
+      bool next(adEntryView &view);
+
+      // additional server control for every page request, owned by caller
+      void add_control(LDAPControl *control);
+      // control returned with last received page or NULL
+      LDAPControl *response_control(const char *oid);
+      // callback for every received page, owned by caller
+      void set_page_callback(adPageCallback *callback);
+      void close();
+
+private:
+      adclient &ad;
+      string OU;
+      int scope;
+      string filter;
+      adAttributeList own_attrs;
+      const adAttributeList *attrs;
+
+      struct berval *cookie;
+      LDAPMessage *page;
+      adMessagePage *holder;
+      LDAPMessage *entry;
+      int msgid;
+      bool morepages;
+      bool pipelined;
+
+      std::vector <LDAPControl *> controls;
+      LDAPControl **returned;
+      adPageCallback *page_callback;
+
+      int pagesize;
+      bool adaptive;
+      size_t page_entries;
+      size_t page_bytes;
+      size_t entry_bytes;
+      struct timeval sent;
+      double latency;
+
+      void init(bool escaped);
+      void release_page();
+      void adapt_pagesize();
+      void send_request();
+      bool fetch_page();
+      LDAPMessage *next_entry();
+
+      adSearchCursor(const adSearchCursor&);
+      adSearchCursor& operator=(const adSearchCursor&);
+};
+
 class adclient {
+friend class adclient_pool;
+friend class adNotifier;
+friend class adMembershipGraph;
+friend class adSearchCursor;
 public:
       adclient();
       ~adclient();
@@ -158,6 +475,9 @@ public:
 
       void groupAddUser(string group, string user);
       void groupRemoveUser(string group, string user);
+      std::map <string, string> groupAddUsers(string group, const std::vector <string> &users);
+      std::map <string, string> groupRemoveUsers(string group, const std::vector <string> &users);
+      std::map <string, string> syncGroupMembers(string group, const std::vector <string> &members);
       void CreateUser(string cn, string container, string user_short);
       void CreateGroup(string cn, string container, string group_short);
       void RenameGroup(string group, string shortname, string cn="");
@@ -213,6 +533,7 @@ public:
 
       bool            ifDNExists(string object, string objectclass);
       bool            ifDNExists(string object);
+      std::vector <bool> ifDNsExist(const std::vector <string> &dns, string objectclass = "*");
 
       std::vector <string> getGroups();
       std::vector <string> getUsers();
@@ -222,6 +543,7 @@ public:
       std::vector <string> getDisabledUsers();
 
       std::vector <string> getUserGroups(string user, bool nested = false);
+      std::vector <bool> ifUsersInGroups(const std::vector < std::pair < string, std::vector <string> > > &questions);
       std::vector <string> getUsersInGroup(string group, bool nested = false);
 
       std::vector <string> getObjectsInOU(string OU, string filter, int scope);
@@ -235,6 +557,19 @@ public:
 
       std::vector <string> searchDN(string search_base, string filter, int scope);
       std::map < string, std::map < string, std::vector<string> > > search(string OU, int scope, string filter, const std::vector <string> &attributes);
+      std::map < string, std::map < string, std::vector<string> > > search(string OU, int scope, string filter, const std::vector <string> &attributes, int pagesize);
+      size_t search_stream(string OU, int scope, string filter, const std::vector <string> &attributes, adSearchCallback &callback, int pagesize = 0);
+      std::map < string, std::map < string, std::vector<string> > > search(string OU, int scope, string filter, const adAttributeList &attributes, int pagesize = 0);
+      size_t search_stream(string OU, int scope, string filter, const adAttributeList &attributes, adSearchCallback &callback, int pagesize = 0);
+      size_t search_columnar(string OU, int scope, string filter, const adAttributeList &attributes, adSearchResult &result, int pagesize = 0);
+      std::map < string, std::map < string, std::vector<string> > > search_asq(string dn, string attribute, string filter, const std::vector <string> &attributes);
+
+      std::map < string, std::map < string, std::vector<string> > > dirsync(string base, const std::vector <string> &attributes, string &cookie, string filter = "(objectclass=*)", int flags = 0);
+      size_t dirsync_stream(string base, const std::vector <string> &attributes, string &cookie, adSearchCallback &callback, string filter = "(objectclass=*)", int flags = 0);
+
+      adUSNWatermark usn_watermark();
+      std::map < string, std::map < string, std::vector<string> > > search_changes(string OU, int scope, string filter, const std::vector <string> &attributes, adUSNWatermark &watermark);
+      size_t search_changes_stream(string OU, int scope, string filter, const std::vector <string> &attributes, adUSNWatermark &watermark, adSearchCallback &callback);
 
       std::map <string, std::vector <string> > getObjectAttributes(string object);
       std::map <string, std::vector <string> > getObjectAttributes(string object, const std::vector<string> &attributes);
@@ -244,8 +579,51 @@ private:
 
       LDAP *ds;
 
-      void login(LDAP **ds, adConnParams& _params);
-      void logout(LDAP *ds);
+      // idle connections dedicated to checkUserPassword
+      std::vector <LDAP *> fastbind_pool;
+      pthread_mutex_t fastbind_mutex;
+
+      LDAP *fastbind_checkout(adConnParams &_params);
+      void fastbind_checkin(LDAP *ld, size_t max_idle);
+      void fastbind_clear();
+
+      // LRU cache of getObjectDN, empty dn - object not found,
+      // adclient_pool points all its connections to one shared cache
+      struct dn_cache_entry {
+          string key;
+          string dn;
+          time_t expires;
+      };
+      struct dn_cache_store {
+          std::list <dn_cache_entry> entries;
+          std::map <string, std::list <dn_cache_entry>::iterator> index;
+          pthread_mutex_t mutex;
+
+          dn_cache_store() { pthread_mutex_init(&mutex, NULL); }
+          ~dn_cache_store() { pthread_mutex_destroy(&mutex); }
+      };
+      dn_cache_store own_dn_cache;
+      dn_cache_store *dn_cache;
+
+      // objectSid (binary) -> sAMAccountName of groups seen in tokenGroups
+      struct sid_cache_entry {
+          string name;
+          time_t expires;
+      };
+      std::map <string, sid_cache_entry> sid_cache;
+
+      std::vector <string> _resolveSIDs(const std::vector <string> &sids);
+
+      bool dn_cache_get(const string &object, string &dn);
+      void dn_cache_put(const string &object, const string &dn);
+      void dn_cache_invalidate(const string &dn);
+      void dn_cache_clear(bool negative_only = false);
+
+      static void connect(LDAP **ds, adConnParams& _params);
+      static void login(LDAP **ds, adConnParams& _params);
+      static void logout(LDAP *ds);
+      void login_parallel(adConnParams& _params);
+      static void *login_thread(void *arg);
 
       void mod_add(string object, string attribute, string value);
       void mod_delete(string object, string attribute, string value);
@@ -254,6 +632,22 @@ private:
       void mod_replace(string object, string attribute, vector <string> list);
       void mod_move(string object, string new_container);
       std::map < string, std::vector<string> > _getvalues(LDAPMessage *entry);
+      std::map < string, std::vector<string> > _getbase(string dn, const std::vector <string> &attributes);
+      string _getbasedn(string base);
+      string _searchUPN(const string &upn);
+      std::vector <string> _probeDNs(const std::vector <string> &dns, string objectclass);
+      std::map <string, string> _getObjectDNs(const std::vector <string> &objects, std::map <string, string> &errors);
+      int _modify_values(const string &dn, int op, const string &attribute, const std::vector <string> &values, size_t first, size_t last);
+      std::map <string, string> _groupModifyMembers(string group, const std::vector <string> &members, int op);
+      void _modify_members(const string &group_dn, int op, const std::vector <string> &values, const std::vector <string> &names, std::map <string, string> &errors);
+      void _modify_members_range(const string &group_dn, int op, const std::vector <string> &values, const std::vector <string> &names, size_t first, size_t last, int result, std::map <string, string> &errors);
+      void _modify_members_failed(int result, const std::vector <string> &names, size_t first, size_t last, std::map <string, string> &errors);
+      void _addOU(string ou, std::pair<string, string> front_ou);
+      void _appendvalues(LDAPMessage *entry, adSearchResult &result);
+      void _getview(LDAPMessage *entry, adMessagePage *page, adEntryView &view);
+      void _getranges(const string &dn, std::map < string, std::vector<string> > &values);
+      int _sendrange(const string &dn, const string &attribute, unsigned int low, unsigned int high);
+      bool _recvrange(int msgid, const string &attribute, std::vector<string> &values);
       string dn2domain(string dn);
       vector < std::pair<string, string> > explode_dn(string dn);
       string merge_dn(vector < std::pair<string, string> > dn_exploded);
@@ -261,8 +655,281 @@ private:
 
       std::string ldap_prefix;
 
-      static std::vector<string> perform_srv_query(string srv_rec);
+      struct srv_record {
+          string host;
+          int port;
+          int priority;
+          int weight;
+          int ttl;
+      };
+      struct srv_cache_entry {
+          time_t expires;
+          std::vector<srv_record> records;
+      };
+      static std::map<string, srv_cache_entry> srv_cache;
+      static pthread_mutex_t srv_cache_mutex;
+      static unsigned int srv_seed;
+
+      static std::vector<srv_record> perform_srv_query(string srv_rec);
+      static bool srv_priority_less(const srv_record &a, const srv_record &b);
+      static std::vector<string> resolve_srv(string srv_rec);
       static struct berval password2berval(string password);
+
+      adclient(const adclient&);
+      adclient& operator=(const adclient&);
+};
+
+class adclient_pool {
+/*
+  Thread-safe pool of bound adclient connections.
+  Every call checks out an idle connection (or opens a new one up to max_size),
+  performs the operation and returns the connection to the pool,
+  so concurrent callers do not serialize on a single LDAP socket.
+*/
+public:
+      adclient_pool(adConnParams _params, unsigned int _min_size = 1, unsigned int _max_size = 8, int _health_interval = 60);
+      ~adclient_pool();
+
+      adclient *checkout();
+      void checkin(adclient *ad, bool broken = false);
+
+      unsigned int size();
+      unsigned int idle();
+
+      void groupAddUser(string group, string user);
+      void groupRemoveUser(string group, string user);
+      std::map <string, string> groupAddUsers(string group, const std::vector <string> &users);
+      std::map <string, string> groupRemoveUsers(string group, const std::vector <string> &users);
+      std::map <string, string> syncGroupMembers(string group, const std::vector <string> &members);
+      void CreateUser(string cn, string container, string user_short);
+      void CreateGroup(string cn, string container, string group_short);
+      void RenameGroup(string group, string shortname, string cn="");
+      void CreateComputer(string name, string container);
+      void CreateOU(string ou);
+      void DeleteDN(string dn);
+      void RenameDN(string object, string cn);
+      void EnableUser(string user);
+      void DisableUser(string user);
+      void UnLockUser(string user);
+      void MoveUser(string user, string new_container);
+      void RenameUser(string user, string shortname, string cn="");
+      void MoveObject(string object, string new_container);
+
+      void setUserPassword(string user, string password);
+      void changeUserPassword(string user, string old_password, string new_password);
+      bool checkUserPassword(string user, string password);
+      void setUserDialinAllowed(string user);
+      void setUserDialinDisabled(string user);
+      void setUserSN(string user, string sn);
+      void setUserInitials(string user, string initials);
+      void setUserGivenName(string user, string givenName);
+      void setUserDisplayName(string user, string displayName);
+      void setUserRoomNumber(string user, string roomNum);
+      void setUserAddress(string user, string streetAddress);
+      void setUserInfo(string user, string info);
+      void setUserTitle(string user, string title);
+      void setUserDepartment(string user, string department);
+      void setUserCompany(string user, string company);
+      void setUserPhone(string user, string phone);
+      void setUserDescription(string user, string descr);
+      void setUserIpAddress(string user, string ip);
+
+      void setObjectAttribute(string object, string attr, string value);
+      void setObjectAttribute(string object, string attr, vector <string> values);
+      void clearObjectAttribute(string object, string attr);
+
+      std::map <string, bool>    getUserControls(string user);
+
+      bool                  getUserControl(string user, string control);
+
+      bool                  ifUserExpired(string user);
+      bool                  ifUserLocked(string user);
+      bool                  ifUserDisabled(string user);
+      bool                  ifUserMustChangePassword(string user);
+      bool                  ifUserDontExpirePassword(string user);
+
+      string          getObjectDN(string object);
+      string          getUserDisplayName(string user);
+      string          getUserIpAddress(string user);
+
+      bool            ifDialinUser(string user);
+
+      bool            ifDNExists(string object, string objectclass);
+      bool            ifDNExists(string object);
+      std::vector <bool> ifDNsExist(const std::vector <string> &dns, string objectclass = "*");
+
+      std::vector <string> getGroups();
+      std::vector <string> getUsers();
+      std::vector <string> getOUs();
+
+      std::vector <string> getDialinUsers();
+      std::vector <string> getDisabledUsers();
+
+      std::vector <string> getUserGroups(string user, bool nested = false);
+      std::vector <bool> ifUsersInGroups(const std::vector < std::pair < string, std::vector <string> > > &questions);
+      std::vector <string> getUsersInGroup(string group, bool nested = false);
+
+      std::vector <string> getObjectsInOU(string OU, string filter, int scope);
+
+      std::vector <string> getOUsInOU(string OU, int scope);
+      std::vector <string> getUsersInOU(string OU, int scope);
+      std::vector <string> getGroupsInOU(string OU, int scope);
+      std::vector <string> getComputersInOU(string OU, int scope);
+
+      std::vector <string> getObjectAttribute(string object, string attribute);
+
+      std::vector <string> searchDN(string search_base, string filter, int scope);
+      std::map < string, std::map < string, std::vector<string> > > search(string OU, int scope, string filter, const std::vector <string> &attributes);
+      std::map < string, std::map < string, std::vector<string> > > search(string OU, int scope, string filter, const std::vector <string> &attributes, int pagesize);
+      size_t search_stream(string OU, int scope, string filter, const std::vector <string> &attributes, adSearchCallback &callback, int pagesize = 0);
+      std::map < string, std::map < string, std::vector<string> > > search(string OU, int scope, string filter, const adAttributeList &attributes, int pagesize = 0);
+      size_t search_stream(string OU, int scope, string filter, const adAttributeList &attributes, adSearchCallback &callback, int pagesize = 0);
+      size_t search_columnar(string OU, int scope, string filter, const adAttributeList &attributes, adSearchResult &result, int pagesize = 0);
+      std::map < string, std::map < string, std::vector<string> > > search_asq(string dn, string attribute, string filter, const std::vector <string> &attributes);
+
+      std::map < string, std::map < string, std::vector<string> > > dirsync(string base, const std::vector <string> &attributes, string &cookie, string filter = "(objectclass=*)", int flags = 0);
+      size_t dirsync_stream(string base, const std::vector <string> &attributes, string &cookie, adSearchCallback &callback, string filter = "(objectclass=*)", int flags = 0);
+
+      adUSNWatermark usn_watermark();
+      std::map < string, std::map < string, std::vector<string> > > search_changes(string OU, int scope, string filter, const std::vector <string> &attributes, adUSNWatermark &watermark);
+      size_t search_changes_stream(string OU, int scope, string filter, const std::vector <string> &attributes, adUSNWatermark &watermark, adSearchCallback &callback);
+
+      std::map <string, std::vector <string> > getObjectAttributes(string object);
+      std::map <string, std::vector <string> > getObjectAttributes(string object, const std::vector<string> &attributes);
+
+private:
+      adConnParams params;
+
+      unsigned int min_size;
+      unsigned int max_size;
+      int health_interval;
+
+      // connections currently opened (idle + checked out)
+      unsigned int total;
+      std::vector < std::pair<adclient *, time_t> > idle_clients;
+
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+
+      // getObjectDN cache shared by all connections, so rename/move/delete
+      // through one of them invalidates it for all
+      adclient::dn_cache_store dn_cache;
+
+      adclient *create();
+      void destroy(adclient *ad);
+      bool healthy(adclient *ad);
+
+      adclient_pool(const adclient_pool&);
+      adclient_pool& operator=(const adclient_pool&);
+};
+
+class adNotifier {
+/*
+  Change notifications (LDAP_SERVER_NOTIFICATION control) on a dedicated connection.
+  Every subscription reports objects changed under 'base' (scope base or one level,
+  AD allows 5 subscriptions per connection by default).
+  Lost connection is reopened and all subscriptions are sent again,
+  refused or dropped subscriptions are retried with growing delay.
+  wait/run/subscribe must be called from one thread, stop() - from any,
+  after stop() wait and run return immediately.
+*/
+public:
+      adNotifier(adConnParams _params);
+      ~adNotifier();
+
+      // returns subscription id
+      int subscribe(string base, int scope, const std::vector <string> &attributes);
+      void unsubscribe(int id);
+
+      // waits up to 'timeout' seconds (-1 - forever) for changed object,
+      // returns false on timeout or stop()
+      bool wait(string &dn, std::map < string, std::vector<string> > &values, int timeout = -1);
+      bool wait(string &dn, std::map < string, std::vector<string> > &values, int &id, int timeout);
+      // passes changed objects to callback until it returns false or stop() is called
+      void run(adSearchCallback &callback);
+      void stop();
+
+private:
+      struct subscription {
+          string base;
+          int scope;
+          std::vector <string> attributes;
+          int msgid;
+      };
+
+      adConnParams params;
+      adclient ad;
+      std::map <int, subscription> subscriptions;
+      int next_id;
+      volatile bool stopping;
+
+      time_t retry_at;
+      unsigned int retry_delay;
+
+      void send(subscription &sub);
+      void reconnect();
+      void resend();
+      void postpone();
+      bool active();
+
+      adNotifier(const adNotifier&);
+      adNotifier& operator=(const adNotifier&);
+};
+
+class adMembershipGraph {
+/*
+  Group membership of the domain, loaded with one paged search of 'member'
+  attribute of all groups, nested membership is computed locally.
+  Objects are identified by DN, short names are resolved with adclient::getObjectDN.
+  refresh() reloads only groups changed since previous load (uSNChanged).
+  Not thread-safe, 'ad' must outlive the graph.
+*/
+public:
+      adMembershipGraph(adclient &_ad, string _base = "");
+
+      // (re)loads all groups
+      void load();
+      // reloads groups changed since last load/refresh, returns their number
+      size_t refresh();
+
+      // members of 'group' (nested - including members of nested groups)
+      std::vector <string> members(string group, bool nested = false);
+      // groups 'object' is member of (nested - including groups of these groups)
+      std::vector <string> groups(string object, bool nested = false);
+      // true if 'object' is nested member of 'group'
+      bool is_member(string object, string group);
+
+      // number of loaded groups
+      size_t size() const;
+
+private:
+      class loader;
+
+      adclient *ad;
+      string base;
+      adUSNWatermark watermark;
+
+      // upper(DN) -> id
+      std::map <string, unsigned> ids;
+      // id -> DN
+      std::vector <string> dns;
+      // id -> 1 if object is loaded group
+      std::vector <char> is_group;
+      // direct edges: id -> members, id -> groups
+      std::vector < std::vector <unsigned> > member;
+      std::vector < std::vector <unsigned> > memberof;
+      // memoized transitive closures, sorted, dropped on every change
+      std::map < unsigned, std::vector <unsigned> > members_closure;
+      std::map < unsigned, std::vector <unsigned> > groups_closure;
+
+      unsigned intern(const string &dn);
+      bool lookup(string object, unsigned &id);
+      void set_members(unsigned group, const std::vector <string> &values);
+      const std::vector <unsigned> &closure(unsigned id, const std::vector < std::vector <unsigned> > &edges, std::map < unsigned, std::vector <unsigned> > &memo);
+      std::vector <string> to_dns(const std::vector <unsigned> &list);
+
+      adMembershipGraph(const adMembershipGraph&);
+      adMembershipGraph& operator=(const adMembershipGraph&);
 };
 
 inline string upper(string input) {
@@ -439,11 +1106,13 @@ inline string decodeSID(string sid) {
     return result.str();
 }
 
+string escape_filter_value(const string &value);
 int sasl_bind_digest_md5(LDAP *ds, string binddn, string bindpw);
 int sasl_bind_simple(LDAP *ds, string binddn, string bindpw);
 #ifdef KRB5
 int krb5_create_cache(const char *domain);
-void krb5_cleanup(krb_struct &krb_param);
+int krb5_bind_gssapi(LDAP *ds, const char *domain);
+void krb5_cleanup();
 int sasl_bind_gssapi(LDAP *ds);
 int sasl_rebind_gssapi(LDAP * ld, LDAP_CONST char *url, ber_tag_t request, ber_int_t msgid, void *params);
 #endif
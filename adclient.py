@@ -20,6 +20,15 @@ class ADConnParams(object):
         self.use_ldaps = False
         self.nettimeout = -1
         self.timelimit = -1
+        self.parallel_connect = 0
+        self.fastbind_connections = 0
+        self.pipelined_search = False
+        self.pagesize = 1000
+        self.adaptive_pagesize = False
+        self.range_parallelism = 0
+        self.dn_cache_size = 0
+        self.dn_cache_ttl = 300
+        self.use_tokengroups = False
         self.uries = []
 
 class ADClient(object):
@@ -0,0 +1,233 @@
+#include "adclient.h"
+
+/*
+  Local group membership graph.
+
+  Every DN seen in 'member' attribute gets small integer id, edges are kept
+  in both directions, so nested members and nested groups are walked
+  without requests to DC.
+*/
+
+class adMembershipGraph::loader : public adSearchCallback {
+public:
+      adMembershipGraph *graph;
+      std::set <unsigned> seen;
+
+      explicit loader(adMembershipGraph *_graph) : graph(_graph) {}
+
+      bool entry(const string &dn, const std::map < string, std::vector<string> > &values) {
+          unsigned id = graph->intern(dn);
+          graph->is_group[id] = 1;
+          std::map < string, std::vector<string> >::const_iterator it = values.find("member");
+          if (it != values.end()) {
+              graph->set_members(id, it->second);
+          } else {
+              graph->set_members(id, std::vector <string>());
+          }
+          seen.insert(id);
+          return true;
+      }
+};
+
+adMembershipGraph::adMembershipGraph(adclient &_ad, string _base) {
+/*
+  Constructor, graph is empty until load() or refresh().
+  Groups are searched under '_base' (adConnParams.search_base by default).
+*/
+    ad = &_ad;
+    base = _base;
+}
+
+void adMembershipGraph::load() {
+/*
+  It drops the graph and loads all groups.
+  It throws ADSearchException on errors.
+*/
+    watermark = adUSNWatermark();
+    ids.clear();
+    dns.clear();
+    is_group.clear();
+    member.clear();
+    memberof.clear();
+    members_closure.clear();
+    groups_closure.clear();
+    refresh();
+}
+
+size_t adMembershipGraph::refresh() {
+/*
+  It reloads 'member' of groups changed since last load() or refresh().
+  Deleted groups are noticed only on full sync (first load or other DC),
+  until then they keep their members.
+  It throws ADSearchException on errors, graph is left partially updated
+  and next refresh() repeats the same changes.
+*/
+    std::vector <string> attributes;
+    attributes.push_back("member");
+
+    loader changes(this);
+    size_t count = ad->search_changes_stream(base.empty() ? ad->params.search_base : base, LDAP_SCOPE_SUBTREE, "(objectclass=group)", attributes, watermark, changes);
+
+    if (watermark.full_sync) {
+        for (unsigned id = 0; id < is_group.size(); ++id) {
+            if (is_group[id] && (changes.seen.find(id) == changes.seen.end())) {
+                set_members(id, std::vector <string>());
+                is_group[id] = 0;
+            }
+        }
+    }
+
+    if (count > 0 || watermark.full_sync) {
+        members_closure.clear();
+        groups_closure.clear();
+    }
+    return count;
+}
+
+std::vector <string> adMembershipGraph::members(string group, bool nested) {
+/*
+  It returns DNs of 'group' members.
+  It throws ADSearchException if 'group' is not loaded group.
+*/
+    unsigned id;
+    if (!lookup(group, id) || !is_group[id]) {
+        throw ADSearchException("Group " + group + " not found", AD_OBJECT_NOT_FOUND);
+    }
+    if (nested) {
+        return to_dns(closure(id, member, members_closure));
+    }
+    return to_dns(member[id]);
+}
+
+std::vector <string> adMembershipGraph::groups(string object, bool nested) {
+/*
+  It returns DNs of groups 'object' is member of,
+  empty vector if 'object' is not member of any group.
+*/
+    unsigned id;
+    if (!lookup(object, id)) {
+        return std::vector <string>();
+    }
+    if (nested) {
+        return to_dns(closure(id, memberof, groups_closure));
+    }
+    return to_dns(memberof[id]);
+}
+
+bool adMembershipGraph::is_member(string object, string group) {
+/*
+  It returns true if 'object' is member of 'group' directly or through nested groups.
+*/
+    unsigned object_id, group_id;
+    if (!lookup(object, object_id) || !lookup(group, group_id)) {
+        return false;
+    }
+    const std::vector <unsigned> &list = closure(object_id, memberof, groups_closure);
+    return std::binary_search(list.begin(), list.end(), group_id);
+}
+
+size_t adMembershipGraph::size() const {
+    size_t count = 0;
+    for (size_t i = 0; i < is_group.size(); ++i) {
+        if (is_group[i]) ++count;
+    }
+    return count;
+}
+
+unsigned adMembershipGraph::intern(const string &dn) {
+/*
+  It returns id of 'dn', new DN gets next id.
+*/
+    string key = upper(dn);
+    std::map <string, unsigned>::iterator it = ids.find(key);
+    if (it != ids.end()) {
+        return it->second;
+    }
+    unsigned id = dns.size();
+    ids[key] = id;
+    dns.push_back(dn);
+    is_group.push_back(0);
+    member.push_back(std::vector <unsigned>());
+    memberof.push_back(std::vector <unsigned>());
+    return id;
+}
+
+bool adMembershipGraph::lookup(string object, unsigned &id) {
+/*
+  It finds id of 'object' (DN or short name, resolved with getObjectDN).
+  It returns false if object is not in the graph.
+*/
+    string dn = object;
+    if (object.find('=') == string::npos) {
+        dn = ad->getObjectDN(object);
+    }
+    std::map <string, unsigned>::iterator it = ids.find(upper(dn));
+    if (it == ids.end()) {
+        return false;
+    }
+    id = it->second;
+    return true;
+}
+
+void adMembershipGraph::set_members(unsigned group, const std::vector <string> &values) {
+/*
+  It replaces direct members of 'group', reverse edges are updated.
+*/
+    std::vector <unsigned> list;
+    list.reserve(values.size());
+    for (size_t i = 0; i < values.size(); ++i) {
+        list.push_back(intern(values[i]));
+    }
+
+    std::vector <unsigned> &old = member[group];
+    for (size_t i = 0; i < old.size(); ++i) {
+        std::vector <unsigned> &back = memberof[old[i]];
+        std::vector <unsigned>::iterator it = std::find(back.begin(), back.end(), group);
+        if (it != back.end()) back.erase(it);
+    }
+
+    for (size_t i = 0; i < list.size(); ++i) {
+        memberof[list[i]].push_back(group);
+    }
+    old.swap(list);
+}
+
+const std::vector <unsigned> &adMembershipGraph::closure(unsigned id, const std::vector < std::vector <unsigned> > &edges, std::map < unsigned, std::vector <unsigned> > &memo) {
+/*
+  It returns sorted ids reachable from 'id' through 'edges' (without 'id' itself).
+  Walk is safe for membership cycles, nodes with memoized closure are not walked again.
+*/
+    std::map < unsigned, std::vector <unsigned> >::iterator found = memo.find(id);
+    if (found != memo.end()) {
+        return found->second;
+    }
+
+    std::set <unsigned> seen;
+    std::vector <unsigned> stack(edges[id].begin(), edges[id].end());
+    while (!stack.empty()) {
+        unsigned next = stack.back();
+        stack.pop_back();
+        if (!seen.insert(next).second) continue;
+
+        std::map < unsigned, std::vector <unsigned> >::iterator known = memo.find(next);
+        if (known != memo.end()) {
+            seen.insert(known->second.begin(), known->second.end());
+        } else {
+            stack.insert(stack.end(), edges[next].begin(), edges[next].end());
+        }
+    }
+    seen.erase(id);
+
+    std::vector <unsigned> &result = memo[id];
+    result.assign(seen.begin(), seen.end());
+    return result;
+}
+
+std::vector <string> adMembershipGraph::to_dns(const std::vector <unsigned> &list) {
+    std::vector <string> result;
+    result.reserve(list.size());
+    for (size_t i = 0; i < list.size(); ++i) {
+        result.push_back(dns[list[i]]);
+    }
+    return result;
+}
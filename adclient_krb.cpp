@@ -19,26 +19,107 @@ using std::endl;
 #define KT_PATH_MAX 256
 #define safe_free(x)    while ((x)) { free((x)); (x) = NULL; }
 
-void
-krb5_cleanup(krb_struct &krb_param)
+/*
+ * credentials are renewed (or reacquired) when less than this
+ * number of seconds left before they expire
+ */
+#define KRB5_RENEW_MARGIN 300
+
+/*
+ * process-wide credential cache shared by all connections,
+ * it is kept between logins and renewed shortly before expiry
+ */
+static krb_struct krb_cache = { NULL, NULL, NULL, NULL, "", 0, 0 };
+
+/*
+ * cache and KRB5CCNAME are process-wide, serialize concurrent logins
+ */
+static pthread_mutex_t krb5_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+krb5_cleanup_unlocked(krb_struct &krb_param)
 {
     if (krb_param.context) {
+        if (krb_param.principal) {
+            krb5_free_principal(krb_param.context, krb_param.principal);
+        }
         if (krb_param.cc) {
             krb5_cc_destroy(krb_param.context, krb_param.cc);
         }
         krb5_free_context(krb_param.context);
     }
+    free(krb_param.mem_cache_env);
+    krb_param.context = NULL;
+    krb_param.cc = NULL;
+    krb_param.principal = NULL;
+    krb_param.mem_cache_env = NULL;
+    krb_param.domain.clear();
+    krb_param.endtime = 0;
+    krb_param.renew_till = 0;
 }
+
 /*
- * create Kerberos memory cache
+ * destroy process credential cache (FILE: cache is removed from disk)
+ * and free Kerberos context, registered with atexit when cache is created
  */
-int
-krb5_create_cache(const char *domain)
+void
+krb5_cleanup()
 {
-    krb_struct krb_param;
-    krb_param.context = NULL;
-    krb_param.cc = NULL;
+    pthread_mutex_lock(&krb5_cache_mutex);
+    krb5_cleanup_unlocked(krb_cache);
+    pthread_mutex_unlock(&krb5_cache_mutex);
+}
 
+/*
+ * remember principal and lifetime of credentials stored in cache
+ */
+static void
+krb5_remember_creds(krb_struct &krb_param, const char *domain, krb5_principal principal, krb5_creds *creds)
+{
+    if (krb_param.principal) {
+        krb5_free_principal(krb_param.context, krb_param.principal);
+        krb_param.principal = NULL;
+    }
+    if (krb5_copy_principal(krb_param.context, principal, &krb_param.principal)) {
+        krb_param.principal = NULL;
+    }
+    krb_param.domain = domain;
+    krb_param.endtime = creds->times.endtime;
+    krb_param.renew_till = creds->times.renew_till;
+}
+
+/*
+ * renew TGT stored in cache without keytab scan and AS exchange
+ */
+static int
+krb5_renew_cache(krb_struct &krb_param)
+{
+    krb5_creds creds;
+    krb5_error_code code;
+
+    memset(&creds, 0, sizeof(creds));
+    code = krb5_get_renewed_creds(krb_param.context, &creds, krb_param.principal, krb_param.cc, NULL);
+    if (code) {
+        return (1);
+    }
+    code = krb5_cc_initialize(krb_param.context, krb_param.cc, krb_param.principal);
+    if (!code) {
+        code = krb5_cc_store_cred(krb_param.context, krb_param.cc, &creds);
+    }
+    if (!code) {
+        krb_param.endtime = creds.times.endtime;
+        krb_param.renew_till = creds.times.renew_till;
+    }
+    krb5_free_cred_contents(krb_param.context, &creds);
+    return (code ? 1 : 0);
+}
+
+/*
+ * create Kerberos memory cache
+ */
+static int
+krb5_create_cache_unlocked(krb_struct &krb_param, const char *domain)
+{
     krb5_keytab keytab = 0;
     krb5_keytab_entry entry;
     krb5_kt_cursor cursor;
@@ -48,7 +129,7 @@ krb5_create_cache(const char *domain)
     char *service;
     char *keytab_name = NULL, *principal_name = NULL, *mem_cache = NULL;
     char buf[KT_PATH_MAX], *p;
-    size_t j,nprinc = 0;
+    size_t j,nprinc = 0, nalloc = 0;
     int retval = 0;
     krb5_error_code code = 0;
 
@@ -59,12 +140,15 @@ krb5_create_cache(const char *domain)
      * Initialise Kerberos
      */
 
-    code = krb5_init_context(&krb_param.context);
-    if (code) {
-        //const char *s = krb5_get_error_message(krb_param.context, code);
-        //cout << "%s| %s: ERROR: Error while initialising Kerberos library: " << s << endl;
-        retval = 1;
-        goto cleanup;
+    if (!krb_param.context) {
+        code = krb5_init_context(&krb_param.context);
+        if (code) {
+            //const char *s = krb5_get_error_message(krb_param.context, code);
+            //cout << "%s| %s: ERROR: Error while initialising Kerberos library: " << s << endl;
+            krb_param.context = NULL;
+            retval = 1;
+            goto cleanup;
+        }
     }
     /*
      * getting default keytab name
@@ -98,13 +182,17 @@ krb5_create_cache(const char *domain)
     while ((code = krb5_kt_next_entry(krb_param.context, keytab, &entry, &cursor)) == 0) {
         int found = 0;
 
-        krb5_principal *new_principal_list;
-        new_principal_list = (krb5_principal *) realloc(principal_list, sizeof(krb5_principal) * (nprinc + 1));
-        if (!new_principal_list) {
-            retval = 1;
-            goto cleanup;
-        } else {
-            principal_list = new_principal_list;
+        if (nprinc == nalloc) {
+            size_t new_nalloc = nalloc ? nalloc * 2 : 16;
+            krb5_principal *new_principal_list;
+            new_principal_list = (krb5_principal *) realloc(principal_list, sizeof(krb5_principal) * new_nalloc);
+            if (!new_principal_list) {
+                retval = 1;
+                goto cleanup;
+            } else {
+                principal_list = new_principal_list;
+                nalloc = new_nalloc;
+            }
         }
         krb5_copy_principal(krb_param.context, entry.principal, &principal_list[nprinc++]);
         //cout << "DEBUG: Keytab entry has realm name: " << krb5_princ_realm(krb_param.context, entry.principal)->data << endl;
@@ -144,30 +232,38 @@ krb5_create_cache(const char *domain)
         goto cleanup;
     }
     /*
-     * prepare memory credential cache
+     * prepare memory credential cache, it is created once per process
      */
+    if (!krb_param.cc) {
 #if  !defined(HAVE_KRB5_MEMORY_CACHE) || defined(HAVE_SUN_LDAP_SDK)
-    mem_cache = (char *) malloc(strlen("FILE:/tmp/libadclient_") + 16);
-    snprintf(mem_cache, strlen("FILE:/tmp/libadclient_") + 16, "FILE:/tmp/libadclient_%d", (int) getpid());
+        mem_cache = (char *) malloc(strlen("FILE:/tmp/libadclient_") + 16);
+        if (mem_cache)
+            snprintf(mem_cache, strlen("FILE:/tmp/libadclient_") + 16, "FILE:/tmp/libadclient_%d", (int) getpid());
 #else
-    mem_cache = (char *) malloc(strlen("MEMORY:libadclient_") + 16);
-    snprintf(mem_cache, strlen("MEMORY:libadclient_") + 16, "MEMORY:libadclient_%d", (int) getpid());
+        mem_cache = (char *) malloc(strlen("MEMORY:libadclient_") + 16);
+        if (mem_cache)
+            snprintf(mem_cache, strlen("MEMORY:libadclient_") + 16, "MEMORY:libadclient_%d", (int) getpid());
 #endif
 
-    if (!mem_cache) {
-        retval = 1;
-        goto cleanup;
-    }
+        if (!mem_cache) {
+            retval = 1;
+            goto cleanup;
+        }
 
-    setenv("KRB5CCNAME", mem_cache, 1);
-    //cout << "DEBUG: Set credential cache to " << mem_cache << endl;
-    code = krb5_cc_resolve(krb_param.context, mem_cache, &krb_param.cc);
-    if (code) {
-        //const char *s = krb5_get_error_message(krb_param.context, code);
-        //cout << "ERROR: Error while resolving memory ccache: " << s << endl;
-        retval = 1;
-        goto cleanup;
+        //cout << "DEBUG: Set credential cache to " << mem_cache << endl;
+        code = krb5_cc_resolve(krb_param.context, mem_cache, &krb_param.cc);
+        if (code) {
+            //const char *s = krb5_get_error_message(krb_param.context, code);
+            //cout << "ERROR: Error while resolving memory ccache: " << s << endl;
+            krb_param.cc = NULL;
+            retval = 1;
+            goto cleanup;
+        }
+        krb_param.mem_cache_env = mem_cache;
+        mem_cache = NULL;
+        atexit(krb5_cleanup);
     }
+    setenv("KRB5CCNAME", krb_param.mem_cache_env, 1);
     /*
      * if no principal name found in keytab for domain use the prinipal name which can get a TGT
      */
@@ -292,6 +388,7 @@ loop_end:
             retval = 1;
             goto cleanup;
         }
+        krb5_remember_creds(krb_param, domain, principal, creds);
         //cout << "DEBUG: Stored credentials" << endl;
     } else {
         //cout << "DEBUG: Got no principal name" << endl;
@@ -313,6 +410,68 @@ cleanup:
     if (creds)
         krb5_free_creds(krb_param.context, creds);
 
-    krb5_cleanup(krb_param);
+    if (retval) {
+        // do not reuse credentials from cache in a failed state
+        krb_param.domain.clear();
+        krb_param.endtime = 0;
+        krb_param.renew_till = 0;
+    }
+    return (retval);
+}
+
+/*
+ * make sure process credential cache holds valid TGT for domain:
+ * reuse it while it is valid, renew it shortly before expiry and
+ * get new credentials from keytab only if renewal is not possible
+ */
+static int
+krb5_refresh_cache_unlocked(const char *domain)
+{
+    int retval = 1;
+    krb5_timestamp now = time(0);
+    bool cached = krb_cache.principal && !strcasecmp(krb_cache.domain.c_str(), domain);
+
+    if (cached && (krb_cache.endtime - now > KRB5_RENEW_MARGIN)) {
+        retval = 0;
+    } else if (cached && (krb_cache.endtime > now) && (krb_cache.renew_till - now > KRB5_RENEW_MARGIN)) {
+        retval = krb5_renew_cache(krb_cache);
+    }
+    if (retval) {
+        retval = krb5_create_cache_unlocked(krb_cache, domain);
+    }
+    return (retval);
+}
+
+int
+krb5_create_cache(const char *domain)
+{
+    if (!domain || !strcmp(domain, ""))
+        return (1);
+
+    pthread_mutex_lock(&krb5_cache_mutex);
+    int retval = krb5_refresh_cache_unlocked(domain);
+    pthread_mutex_unlock(&krb5_cache_mutex);
+    return (retval);
+}
+
+/*
+ * GSSAPI bind with credentials of process cache (refreshed first, see krb5_create_cache),
+ * NULL domain - domain of credentials already in cache (rebind).
+ * Cache is locked for the whole bind, so concurrent login can not
+ * reinitialize it while GSSAPI reads it.
+ * It returns LDAP result code, -1 if credentials can not be obtained.
+ */
+int
+krb5_bind_gssapi(LDAP *ds, const char *domain)
+{
+    pthread_mutex_lock(&krb5_cache_mutex);
+
+    string realm = domain ? domain : krb_cache.domain;
+    int retval = -1;
+    if (!realm.empty() && (krb5_refresh_cache_unlocked(realm.c_str()) == 0)) {
+        retval = sasl_bind_gssapi(ds);
+    }
+
+    pthread_mutex_unlock(&krb5_cache_mutex);
     return (retval);
 }
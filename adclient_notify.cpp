@@ -0,0 +1,277 @@
+#include "adclient.h"
+
+/*
+  Change notification subscriptions.
+
+  AD keeps notification search running and sends every object changed
+  under subscribed base as a search entry, search result is sent only
+  when subscription is dropped by server.
+*/
+
+adNotifier::adNotifier(adConnParams _params) {
+/*
+  Constructor, opens dedicated connection.
+  It throws ADBindException on failure.
+*/
+    params = _params;
+    // notification search never ends, server time limit would drop it
+    params.timelimit = -1;
+    next_id = 1;
+    retry_at = 0;
+    retry_delay = 1;
+    stopping = false;
+    ad.login(params);
+}
+
+adNotifier::~adNotifier() {
+/*
+  Destructor, subscriptions are dropped with connection.
+*/
+    for (std::map <int, subscription>::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        if ((it->second.msgid != -1) && (ad.ds != NULL)) {
+            ldap_abandon_ext(ad.ds, it->second.msgid, NULL, NULL);
+        }
+    }
+}
+
+void adNotifier::send(subscription &sub) {
+/*
+  It sends notification search for subscription.
+  It throws ADSearchException on errors.
+*/
+    if (ad.ds == NULL) throw ADSearchException("Failed to use LDAP connection handler", AD_LDAP_CONNECTION_ERROR);
+
+    adAttributeList attrs(sub.attributes);
+
+    LDAPControl notification_control;
+    notification_control.ldctl_oid = const_cast<char *>(AD_CONTROL_NOTIFICATION);
+    notification_control.ldctl_value.bv_val = NULL;
+    notification_control.ldctl_value.bv_len = 0;
+    notification_control.ldctl_iscritical = 1;
+    LDAPControl *serverctrls[2] = { &notification_control, NULL };
+
+    // AD accepts only (objectclass=*) filter for notifications
+    int result = ldap_search_ext(ad.ds, sub.base.c_str(), sub.scope, "(objectclass=*)", attrs.c_array(), 0, serverctrls, NULL, NULL, LDAP_NO_LIMIT, &sub.msgid);
+    if (result != LDAP_SUCCESS) {
+        sub.msgid = -1;
+        string error_msg = "Error in notification ldap_search_ext: ";
+        error_msg.append(ldap_err2string(result));
+        throw ADSearchException(error_msg, result);
+    }
+}
+
+void adNotifier::reconnect() {
+/*
+  It opens new connection and sends all subscriptions again.
+  It throws ADBindException on failure.
+*/
+    adclient::logout(ad.ds);
+    ad.ds = NULL;
+    for (std::map <int, subscription>::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        it->second.msgid = -1;
+    }
+
+    ad.login(params);
+
+    retry_at = 0;
+    resend();
+}
+
+void adNotifier::resend() {
+/*
+  It sends subscriptions which are not active (failed or dropped by server).
+  Failures are retried with growing delay (up to a minute).
+*/
+    if (time(NULL) < retry_at) return;
+
+    bool failed = false;
+    for (std::map <int, subscription>::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        if (it->second.msgid != -1) continue;
+        try {
+            send(it->second);
+        } catch (ADSearchException&) {
+            failed = true;
+        }
+    }
+
+    if (failed) {
+        postpone();
+    } else {
+        retry_delay = 1;
+    }
+}
+
+void adNotifier::postpone() {
+    retry_at = time(NULL) + retry_delay;
+    retry_delay = (retry_delay < 60) ? retry_delay * 2 : 60;
+}
+
+bool adNotifier::active() {
+    for (std::map <int, subscription>::iterator it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+        if (it->second.msgid != -1) return true;
+    }
+    return false;
+}
+
+int adNotifier::subscribe(string base, int scope, const vector <string> &attributes) {
+/*
+  It starts notifications for objects under 'base'.
+  It returns subscription id, throws ADSearchException on errors.
+*/
+    subscription sub;
+    sub.base = base;
+    sub.scope = scope;
+    sub.attributes = attributes;
+    sub.msgid = -1;
+
+    send(sub);
+
+    int id = next_id++;
+    subscriptions[id] = sub;
+    return id;
+}
+
+void adNotifier::unsubscribe(int id) {
+    std::map <int, subscription>::iterator it = subscriptions.find(id);
+    if (it == subscriptions.end()) return;
+
+    if ((it->second.msgid != -1) && (ad.ds != NULL)) {
+        ldap_abandon_ext(ad.ds, it->second.msgid, NULL, NULL);
+    }
+    subscriptions.erase(it);
+}
+
+bool adNotifier::wait(string &dn, map < string, vector<string> > &values, int timeout) {
+    int id;
+    return wait(dn, values, id, timeout);
+}
+
+bool adNotifier::wait(string &dn, map < string, vector<string> > &values, int &id, int timeout) {
+/*
+  It waits for next changed object of any subscription and fills
+  'dn', 'values' and subscription 'id'.
+  It returns false on timeout or stop(), timeout 0 polls once.
+  Lost connection is reopened, ADBindException is thrown if it can not be.
+  Refused or dropped subscriptions are sent again with growing delay.
+*/
+    time_t deadline = (timeout < 0) ? 0 : time(NULL) + timeout;
+    bool polled = false;
+
+    while (!stopping) {
+        if (subscriptions.empty()) {
+            throw ADSearchException("No notification subscriptions", AD_PARAMS_ERROR);
+        }
+        if (ad.ds == NULL) {
+            reconnect();
+        }
+        resend();
+
+        // wake up every second to check stop()
+        struct timeval tv;
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (timeout >= 0) {
+            time_t left = deadline - time(NULL);
+            if (left <= 0) {
+                if (polled) return false;
+                tv.tv_sec = 0;
+            } else if (left < tv.tv_sec) {
+                tv.tv_sec = left;
+            }
+        }
+        polled = true;
+
+        if (!active()) {
+            // nothing to receive until subscriptions are sent again
+            if (tv.tv_sec > 0) sleep(1);
+            continue;
+        }
+
+        LDAPMessage *res = NULL;
+        int result = ldap_result(ad.ds, LDAP_RES_ANY, LDAP_MSG_ONE, &tv, &res);
+        if (result == 0) {
+            continue;
+        }
+        if (result == -1) {
+            ldap_msgfree(res);
+            reconnect();
+            continue;
+        }
+
+        int msgid = ldap_msgid(res);
+        std::map <int, subscription>::iterator sub = subscriptions.begin();
+        for (; sub != subscriptions.end(); ++sub) {
+            if (sub->second.msgid == msgid) break;
+        }
+
+        if (result == LDAP_RES_SEARCH_ENTRY && sub != subscriptions.end()) {
+            char *cdn = ldap_get_dn(ad.ds, res);
+            if (cdn == NULL) {
+                ldap_msgfree(res);
+                throw ADSearchException("Error in ldap_get_dn", AD_LDAP_CONNECTION_ERROR);
+            }
+            dn = cdn;
+            ldap_memfree(cdn);
+            try {
+                values = ad._getvalues(res);
+            } catch (ADSearchException&) {
+                ldap_msgfree(res);
+                throw;
+            }
+            ldap_msgfree(res);
+            id = sub->first;
+            return true;
+        }
+
+        if (result == LDAP_RES_SEARCH_RESULT && sub != subscriptions.end()) {
+            // server dropped subscription (e.g. on shutdown), send it again
+            int errcodep = LDAP_SUCCESS;
+            ldap_parse_result(ad.ds, res, &errcodep, NULL, NULL, NULL, NULL, false);
+            ldap_msgfree(res);
+            sub->second.msgid = -1;
+            if ((errcodep == LDAP_UNAVAILABLE) || (errcodep == LDAP_SERVER_DOWN) || (errcodep == LDAP_BUSY)) {
+                reconnect();
+            } else if (errcodep != LDAP_SUCCESS) {
+                // refused, e.g. too many subscriptions
+                postpone();
+            }
+            continue;
+        }
+
+        // referrals, results of abandoned subscriptions
+        ldap_msgfree(res);
+    }
+    return false;
+}
+
+void adNotifier::run(adSearchCallback &callback) {
+/*
+  It passes changed objects to callback until callback returns false or stop() is called.
+  Connection errors are retried with growing delay (up to a minute).
+*/
+    unsigned int delay = 1;
+
+    string dn;
+    map < string, vector<string> > values;
+    while (!stopping) {
+        try {
+            if (!wait(dn, values)) break;
+            delay = 1;
+        }
+        catch (ADBindException&) {
+            for (unsigned int i = 0; (i < delay) && !stopping; ++i) {
+                sleep(1);
+            }
+            delay = (delay < 60) ? delay * 2 : 60;
+            continue;
+        }
+        if (!callback.entry(dn, values)) break;
+    }
+}
+
+void adNotifier::stop() {
+/*
+  It makes wait and run return, notifier can't be used after that.
+*/
+    stopping = true;
+}
@@ -0,0 +1,536 @@
+#include "adclient.h"
+
+/*
+  Pool of bound adclient connections.
+
+  adclient_pool can be shared between threads, every public method
+  checks out a connection, calls the same adclient method on it and
+  returns the connection back.
+  Exceptions are the same as in adclient.
+*/
+
+class adclient_lease {
+/*
+  Returns checked out connection to the pool when leaving scope.
+  Connection is dropped instead if the call failed on connection level.
+*/
+public:
+      adclient_lease(adclient_pool &_pool) : pool(_pool), broken(false) {
+          ad = pool.checkout();
+      }
+      ~adclient_lease() {
+          pool.checkin(ad, broken);
+      }
+      adclient *operator->() { return ad; }
+
+      void failed(int code) {
+          if ((code == LDAP_SERVER_DOWN) ||
+              (code == LDAP_CONNECT_ERROR) ||
+              (code == LDAP_TIMEOUT) ||
+              (code == AD_LDAP_CONNECTION_ERROR)) {
+              broken = true;
+          }
+      }
+private:
+      adclient_pool &pool;
+      adclient *ad;
+      bool broken;
+};
+
+#define POOL_CALL(call) \
+    adclient_lease lease(*this); \
+    try { \
+        return lease->call; \
+    } \
+    catch (ADException& ex) { \
+        lease.failed(ex.code); \
+        throw; \
+    }
+
+adclient_pool::adclient_pool(adConnParams _params, unsigned int _min_size, unsigned int _max_size, int _health_interval) {
+/*
+  Constructor, opens min_size connections.
+  It throws ADBindException if any of them can not be opened.
+*/
+    params = _params;
+    max_size = (_max_size == 0) ? 1 : _max_size;
+    min_size = (_min_size > max_size) ? max_size : _min_size;
+    health_interval = _health_interval;
+    total = 0;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+
+    try {
+        for (unsigned int i = 0; i < min_size; ++i) {
+            adclient *ad = create();
+            total++;
+            idle_clients.push_back(std::make_pair(ad, time(0)));
+        }
+    }
+    catch (ADBindException&) {
+        for (unsigned int i = 0; i < idle_clients.size(); ++i) {
+            destroy(idle_clients[i].first);
+        }
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+        throw;
+    }
+}
+
+adclient_pool::~adclient_pool() {
+/*
+  Destructor, closes all idle connections.
+  Connections must be returned to the pool before it is destroyed.
+*/
+    for (unsigned int i = 0; i < idle_clients.size(); ++i) {
+        destroy(idle_clients[i].first);
+    }
+    idle_clients.clear();
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+}
+
+adclient *adclient_pool::create() {
+    adclient *ad = new adclient();
+    try {
+        ad->login(params);
+    }
+    catch (ADBindException&) {
+        delete ad;
+        throw;
+    }
+    ad->dn_cache = &dn_cache;
+    return ad;
+}
+
+void adclient_pool::destroy(adclient *ad) {
+    delete ad;
+}
+
+bool adclient_pool::healthy(adclient *ad) {
+/*
+  It returns true if connection still answers rootDSE base search.
+*/
+    if (ad->ds == NULL) return false;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+    char *attrs[] = {"1.1", NULL};
+#pragma GCC diagnostic pop
+    LDAPMessage *res = NULL;
+
+    int result = ldap_search_ext_s(ad->ds, "", LDAP_SCOPE_BASE, "(objectclass=*)", attrs, 1, NULL, NULL, NULL, LDAP_NO_LIMIT, &res);
+    ldap_msgfree(res);
+
+    return (result == LDAP_SUCCESS);
+}
+
+adclient *adclient_pool::checkout() {
+/*
+  It returns bound connection for exclusive use by caller.
+  Connections idle for more than health_interval seconds are checked before reuse.
+  It blocks while max_size connections are in use.
+  It throws ADBindException if new connection can not be opened.
+*/
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        if (!idle_clients.empty()) {
+            std::pair<adclient *, time_t> entry = idle_clients.back();
+            idle_clients.pop_back();
+            pthread_mutex_unlock(&mutex);
+
+            if ((health_interval < 0) ||
+                (time(0) - entry.second < health_interval) ||
+                healthy(entry.first)) {
+                return entry.first;
+            }
+
+            destroy(entry.first);
+            pthread_mutex_lock(&mutex);
+            total--;
+            continue;
+        }
+        if (total < max_size) {
+            break;
+        }
+        pthread_cond_wait(&cond, &mutex);
+    }
+    // reserve slot for new connection before releasing the lock
+    total++;
+    pthread_mutex_unlock(&mutex);
+
+    try {
+        return create();
+    }
+    catch (ADBindException&) {
+        pthread_mutex_lock(&mutex);
+        total--;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+        throw;
+    }
+}
+
+void adclient_pool::checkin(adclient *ad, bool broken) {
+/*
+  It returns connection obtained with checkout back to the pool.
+  Broken connections are closed.
+*/
+    if (ad == NULL) return;
+
+    if (broken) {
+        destroy(ad);
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (broken) {
+        total--;
+    } else {
+        idle_clients.push_back(std::make_pair(ad, time(0)));
+    }
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+unsigned int adclient_pool::size() {
+    pthread_mutex_lock(&mutex);
+    unsigned int result = total;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+unsigned int adclient_pool::idle() {
+    pthread_mutex_lock(&mutex);
+    unsigned int result = idle_clients.size();
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+void adclient_pool::groupAddUser(string group, string user) {
+    POOL_CALL(groupAddUser(group, user));
+}
+
+void adclient_pool::groupRemoveUser(string group, string user) {
+    POOL_CALL(groupRemoveUser(group, user));
+}
+
+void adclient_pool::CreateUser(string cn, string container, string user_short) {
+    POOL_CALL(CreateUser(cn, container, user_short));
+}
+
+void adclient_pool::CreateGroup(string cn, string container, string group_short) {
+    POOL_CALL(CreateGroup(cn, container, group_short));
+}
+
+void adclient_pool::RenameGroup(string group, string shortname, string cn) {
+    POOL_CALL(RenameGroup(group, shortname, cn));
+}
+
+void adclient_pool::CreateComputer(string name, string container) {
+    POOL_CALL(CreateComputer(name, container));
+}
+
+void adclient_pool::CreateOU(string ou) {
+    POOL_CALL(CreateOU(ou));
+}
+
+void adclient_pool::DeleteDN(string dn) {
+    POOL_CALL(DeleteDN(dn));
+}
+
+void adclient_pool::RenameDN(string object, string cn) {
+    POOL_CALL(RenameDN(object, cn));
+}
+
+void adclient_pool::EnableUser(string user) {
+    POOL_CALL(EnableUser(user));
+}
+
+void adclient_pool::DisableUser(string user) {
+    POOL_CALL(DisableUser(user));
+}
+
+void adclient_pool::UnLockUser(string user) {
+    POOL_CALL(UnLockUser(user));
+}
+
+void adclient_pool::MoveUser(string user, string new_container) {
+    POOL_CALL(MoveUser(user, new_container));
+}
+
+void adclient_pool::RenameUser(string user, string shortname, string cn) {
+    POOL_CALL(RenameUser(user, shortname, cn));
+}
+
+void adclient_pool::MoveObject(string object, string new_container) {
+    POOL_CALL(MoveObject(object, new_container));
+}
+
+void adclient_pool::setUserPassword(string user, string password) {
+    POOL_CALL(setUserPassword(user, password));
+}
+
+void adclient_pool::changeUserPassword(string user, string old_password, string new_password) {
+    POOL_CALL(changeUserPassword(user, old_password, new_password));
+}
+
+bool adclient_pool::checkUserPassword(string user, string password) {
+    POOL_CALL(checkUserPassword(user, password));
+}
+
+void adclient_pool::setUserDialinAllowed(string user) {
+    POOL_CALL(setUserDialinAllowed(user));
+}
+
+void adclient_pool::setUserDialinDisabled(string user) {
+    POOL_CALL(setUserDialinDisabled(user));
+}
+
+void adclient_pool::setUserSN(string user, string sn) {
+    POOL_CALL(setUserSN(user, sn));
+}
+
+void adclient_pool::setUserInitials(string user, string initials) {
+    POOL_CALL(setUserInitials(user, initials));
+}
+
+void adclient_pool::setUserGivenName(string user, string givenName) {
+    POOL_CALL(setUserGivenName(user, givenName));
+}
+
+void adclient_pool::setUserDisplayName(string user, string displayName) {
+    POOL_CALL(setUserDisplayName(user, displayName));
+}
+
+void adclient_pool::setUserRoomNumber(string user, string roomNum) {
+    POOL_CALL(setUserRoomNumber(user, roomNum));
+}
+
+void adclient_pool::setUserAddress(string user, string streetAddress) {
+    POOL_CALL(setUserAddress(user, streetAddress));
+}
+
+void adclient_pool::setUserInfo(string user, string info) {
+    POOL_CALL(setUserInfo(user, info));
+}
+
+void adclient_pool::setUserTitle(string user, string title) {
+    POOL_CALL(setUserTitle(user, title));
+}
+
+void adclient_pool::setUserDepartment(string user, string department) {
+    POOL_CALL(setUserDepartment(user, department));
+}
+
+void adclient_pool::setUserCompany(string user, string company) {
+    POOL_CALL(setUserCompany(user, company));
+}
+
+void adclient_pool::setUserPhone(string user, string phone) {
+    POOL_CALL(setUserPhone(user, phone));
+}
+
+void adclient_pool::setUserDescription(string user, string descr) {
+    POOL_CALL(setUserDescription(user, descr));
+}
+
+void adclient_pool::setUserIpAddress(string user, string ip) {
+    POOL_CALL(setUserIpAddress(user, ip));
+}
+
+void adclient_pool::setObjectAttribute(string object, string attr, string value) {
+    POOL_CALL(setObjectAttribute(object, attr, value));
+}
+
+void adclient_pool::setObjectAttribute(string object, string attr, vector <string> values) {
+    POOL_CALL(setObjectAttribute(object, attr, values));
+}
+
+void adclient_pool::clearObjectAttribute(string object, string attr) {
+    POOL_CALL(clearObjectAttribute(object, attr));
+}
+
+map <string, bool> adclient_pool::getUserControls(string user) {
+    POOL_CALL(getUserControls(user));
+}
+
+bool adclient_pool::getUserControl(string user, string control) {
+    POOL_CALL(getUserControl(user, control));
+}
+
+bool adclient_pool::ifUserExpired(string user) {
+    POOL_CALL(ifUserExpired(user));
+}
+
+bool adclient_pool::ifUserLocked(string user) {
+    POOL_CALL(ifUserLocked(user));
+}
+
+bool adclient_pool::ifUserDisabled(string user) {
+    POOL_CALL(ifUserDisabled(user));
+}
+
+bool adclient_pool::ifUserMustChangePassword(string user) {
+    POOL_CALL(ifUserMustChangePassword(user));
+}
+
+bool adclient_pool::ifUserDontExpirePassword(string user) {
+    POOL_CALL(ifUserDontExpirePassword(user));
+}
+
+string adclient_pool::getObjectDN(string object) {
+    POOL_CALL(getObjectDN(object));
+}
+
+string adclient_pool::getUserDisplayName(string user) {
+    POOL_CALL(getUserDisplayName(user));
+}
+
+string adclient_pool::getUserIpAddress(string user) {
+    POOL_CALL(getUserIpAddress(user));
+}
+
+bool adclient_pool::ifDialinUser(string user) {
+    POOL_CALL(ifDialinUser(user));
+}
+
+bool adclient_pool::ifDNExists(string object, string objectclass) {
+    POOL_CALL(ifDNExists(object, objectclass));
+}
+
+bool adclient_pool::ifDNExists(string object) {
+    POOL_CALL(ifDNExists(object));
+}
+
+vector <bool> adclient_pool::ifDNsExist(const vector <string> &dns, string objectclass) {
+    POOL_CALL(ifDNsExist(dns, objectclass));
+}
+
+vector <string> adclient_pool::getGroups() {
+    POOL_CALL(getGroups());
+}
+
+vector <string> adclient_pool::getUsers() {
+    POOL_CALL(getUsers());
+}
+
+vector <string> adclient_pool::getOUs() {
+    POOL_CALL(getOUs());
+}
+
+vector <string> adclient_pool::getDialinUsers() {
+    POOL_CALL(getDialinUsers());
+}
+
+vector <string> adclient_pool::getDisabledUsers() {
+    POOL_CALL(getDisabledUsers());
+}
+
+vector <string> adclient_pool::getUserGroups(string user, bool nested) {
+    POOL_CALL(getUserGroups(user, nested));
+}
+
+map <string, string> adclient_pool::groupAddUsers(string group, const vector <string> &users) {
+    POOL_CALL(groupAddUsers(group, users));
+}
+
+map <string, string> adclient_pool::groupRemoveUsers(string group, const vector <string> &users) {
+    POOL_CALL(groupRemoveUsers(group, users));
+}
+
+map <string, string> adclient_pool::syncGroupMembers(string group, const vector <string> &members) {
+    POOL_CALL(syncGroupMembers(group, members));
+}
+
+vector <bool> adclient_pool::ifUsersInGroups(const vector < std::pair < string, vector <string> > > &questions) {
+    POOL_CALL(ifUsersInGroups(questions));
+}
+
+vector <string> adclient_pool::getUsersInGroup(string group, bool nested) {
+    POOL_CALL(getUsersInGroup(group, nested));
+}
+
+vector <string> adclient_pool::getObjectsInOU(string OU, string filter, int scope) {
+    POOL_CALL(getObjectsInOU(OU, filter, scope));
+}
+
+vector <string> adclient_pool::getOUsInOU(string OU, int scope) {
+    POOL_CALL(getOUsInOU(OU, scope));
+}
+
+vector <string> adclient_pool::getUsersInOU(string OU, int scope) {
+    POOL_CALL(getUsersInOU(OU, scope));
+}
+
+vector <string> adclient_pool::getGroupsInOU(string OU, int scope) {
+    POOL_CALL(getGroupsInOU(OU, scope));
+}
+
+vector <string> adclient_pool::getComputersInOU(string OU, int scope) {
+    POOL_CALL(getComputersInOU(OU, scope));
+}
+
+vector <string> adclient_pool::getObjectAttribute(string object, string attribute) {
+    POOL_CALL(getObjectAttribute(object, attribute));
+}
+
+vector <string> adclient_pool::searchDN(string search_base, string filter, int scope) {
+    POOL_CALL(searchDN(search_base, filter, scope));
+}
+
+map < string, map < string, vector<string> > > adclient_pool::search(string OU, int scope, string filter, const vector <string> &attributes) {
+    POOL_CALL(search(OU, scope, filter, attributes));
+}
+
+map < string, map < string, vector<string> > > adclient_pool::search(string OU, int scope, string filter, const vector <string> &attributes, int pagesize) {
+    POOL_CALL(search(OU, scope, filter, attributes, pagesize));
+}
+
+size_t adclient_pool::search_stream(string OU, int scope, string filter, const vector <string> &attributes, adSearchCallback &callback, int pagesize) {
+    POOL_CALL(search_stream(OU, scope, filter, attributes, callback, pagesize));
+}
+
+map < string, map < string, vector<string> > > adclient_pool::search(string OU, int scope, string filter, const adAttributeList &attributes, int pagesize) {
+    POOL_CALL(search(OU, scope, filter, attributes, pagesize));
+}
+
+size_t adclient_pool::search_stream(string OU, int scope, string filter, const adAttributeList &attributes, adSearchCallback &callback, int pagesize) {
+    POOL_CALL(search_stream(OU, scope, filter, attributes, callback, pagesize));
+}
+
+map < string, map < string, vector<string> > > adclient_pool::dirsync(string base, const vector <string> &attributes, string &cookie, string filter, int flags) {
+    POOL_CALL(dirsync(base, attributes, cookie, filter, flags));
+}
+
+size_t adclient_pool::dirsync_stream(string base, const vector <string> &attributes, string &cookie, adSearchCallback &callback, string filter, int flags) {
+    POOL_CALL(dirsync_stream(base, attributes, cookie, callback, filter, flags));
+}
+
+adUSNWatermark adclient_pool::usn_watermark() {
+    POOL_CALL(usn_watermark());
+}
+
+map < string, map < string, vector<string> > > adclient_pool::search_changes(string OU, int scope, string filter, const vector <string> &attributes, adUSNWatermark &watermark) {
+    POOL_CALL(search_changes(OU, scope, filter, attributes, watermark));
+}
+
+size_t adclient_pool::search_changes_stream(string OU, int scope, string filter, const vector <string> &attributes, adUSNWatermark &watermark, adSearchCallback &callback) {
+    POOL_CALL(search_changes_stream(OU, scope, filter, attributes, watermark, callback));
+}
+
+map < string, map < string, vector<string> > > adclient_pool::search_asq(string dn, string attribute, string filter, const vector <string> &attributes) {
+    POOL_CALL(search_asq(dn, attribute, filter, attributes));
+}
+
+size_t adclient_pool::search_columnar(string OU, int scope, string filter, const adAttributeList &attributes, adSearchResult &result, int pagesize) {
+    POOL_CALL(search_columnar(OU, scope, filter, attributes, result, pagesize));
+}
+
+map <string, vector <string> > adclient_pool::getObjectAttributes(string object) {
+    POOL_CALL(getObjectAttributes(object));
+}
+
+map <string, vector <string> > adclient_pool::getObjectAttributes(string object, const vector<string> &attributes) {
+    POOL_CALL(getObjectAttributes(object, attributes));
+}
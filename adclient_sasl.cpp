@@ -80,6 +80,9 @@ int sasl_bind_simple(LDAP *ds, string binddn, string bindpw) {
 
 
 #ifdef KRB5
+// adclient_krb.cpp
+int krb5_bind_gssapi(LDAP *ds, const char *domain);
+
 struct sasl_defaults_gssapi {
     char *mech;
     char *realm;
@@ -174,6 +177,6 @@ int sasl_rebind_gssapi(LDAP * ld,
                               ber_tag_t request,
                               ber_int_t msgid,
                               void *params) {
-    return sasl_bind_gssapi(ld);
+    return krb5_bind_gssapi(ld, NULL);
 }
 #endif
@@ -5,6 +5,7 @@ import (
 	"os"
 	"reflect"
 	"sort"
+	"strings"
 	"testing"
 )
 
@@ -241,3 +242,86 @@ func TestUserGroups(t *testing.T) {
 		}
 	}
 }
+
+func TestSyncGroupMembers(t *testing.T) {
+	dn1, err := GetObjectDN(TestUser1.ShortName)
+	if err != nil {
+		t.Fatalf("Failed to GetObjectDN('%+v') - '%+v'", TestUser1.ShortName, err)
+	}
+	dn2, err := GetObjectDN(TestUser2.ShortName)
+	if err != nil {
+		t.Fatalf("Failed to GetObjectDN('%+v') - '%+v'", TestUser2.ShortName, err)
+	}
+	// not canonical spelling of member DNs
+	spaced1 := strings.Replace(dn1, ",", ", ", -1)
+	spaced2 := strings.Replace(dn2, ",", ", ", -1)
+
+	checkMembers := func(expected []string) {
+		users, err := GetUsersInGroup(TestGroup1.CommonName, false)
+		if err != nil {
+			t.Fatalf("Failed to GetUsersInGroup('%+v') - '%+v'", TestGroup1.ShortName, err)
+		}
+		sort.Strings(expected)
+		sort.Strings(users)
+		if !reflect.DeepEqual(users, expected) {
+			t.Fatalf("'%+v' users expected to be '%+v', got '%+v'", TestGroup1.CommonName, expected, users)
+		}
+	}
+
+	t.Logf("Syncing '%+v' to '%+v' and '%+v'", TestGroup1.CommonName, spaced1, TestUser2.ShortName)
+	if errors, err := SyncGroupMembers(TestGroup1.ShortName, []string{spaced1, TestUser2.ShortName}); err != nil {
+		t.Fatalf("Failed to SyncGroupMembers('%+v') - '%+v'", TestGroup1.ShortName, err)
+	} else if len(errors) != 0 {
+		t.Fatalf("SyncGroupMembers('%+v') failed for '%+v'", TestGroup1.ShortName, errors)
+	}
+	checkMembers([]string{TestUser1.ShortName, TestUser2.ShortName})
+
+	t.Logf("Syncing '%+v' to '%+v'", TestGroup1.CommonName, spaced2)
+	if errors, err := SyncGroupMembers(TestGroup1.ShortName, []string{spaced2}); err != nil {
+		t.Fatalf("Failed to SyncGroupMembers('%+v') - '%+v'", TestGroup1.ShortName, err)
+	} else if len(errors) != 0 {
+		t.Fatalf("SyncGroupMembers('%+v') failed for '%+v'", TestGroup1.ShortName, errors)
+	}
+	checkMembers([]string{TestUser2.ShortName})
+}
+
+func TestDNCacheInvalidation(t *testing.T) {
+	params := DefaultADConnParams()
+	params.Uries = LDAPServer
+	params.Binddn = LDAPUser
+	params.Bindpw = LDAPPasswd
+	params.Search_base = LDAPSearchBase
+	params.DNCacheSize = 100
+	if err := Login(params); err != nil {
+		t.Fatalf("Failed to Login with DN cache - '%+v'", err)
+	}
+	defer func() {
+		params.DNCacheSize = 0
+		Login(params)
+	}()
+
+	domain := strings.Replace(strings.Replace(LDAPSearchBase, "DC=", "", -1), ",", ".", -1)
+	oldUPN := TestUser1.ShortName + "@" + domain
+	newUPN := TestUser1.ShortName + ".renamed@" + domain
+
+	if err := SetObjectAttribute(TestUser1.ShortName, "userPrincipalName", oldUPN); err != nil {
+		t.Fatalf("Failed to SetObjectAttribute('%+v') - '%+v'", TestUser1.ShortName, err)
+	}
+	dn, err := GetObjectDN(oldUPN)
+	if err != nil {
+		t.Fatalf("Failed to GetObjectDN('%+v') - '%+v'", oldUPN, err)
+	}
+
+	t.Logf("Changing userPrincipalName of '%+v' to '%+v'", TestUser1.CommonName, newUPN)
+	if err := SetObjectAttribute(TestUser1.ShortName, "userPrincipalName", newUPN); err != nil {
+		t.Fatalf("Failed to SetObjectAttribute('%+v') - '%+v'", TestUser1.ShortName, err)
+	}
+	if _, err := GetObjectDN(oldUPN); err == nil {
+		t.Errorf("GetObjectDN('%+v') expected to fail after userPrincipalName change", oldUPN)
+	}
+	if found, err := GetObjectDN(newUPN); err != nil {
+		t.Errorf("Failed to GetObjectDN('%+v') - '%+v'", newUPN, err)
+	} else if found != dn {
+		t.Errorf("GetObjectDN('%+v') expected to be '%+v', got '%+v'", newUPN, dn, found)
+	}
+}
@@ -39,8 +39,17 @@ type ADConnParams struct {
 	UseLDAPS    bool
 	UseStartTLS bool
 
-	Nettimeout int
-	Timelimit  int
+	Nettimeout          int
+	Timelimit           int
+	ParallelConnect     int
+	FastbindConnections int
+	PipelinedSearch     bool
+	Pagesize            int
+	AdaptivePagesize    bool
+	RangeParallelism    int
+	DNCacheSize         int
+	DNCacheTTL          int
+	UseTokenGroups      bool
 }
 
 func DefaultADConnParams() (params ADConnParams) {
@@ -50,6 +59,15 @@ func DefaultADConnParams() (params ADConnParams) {
 	params.UseGSSAPI = false
 	params.UseLDAPS = false
 	params.UseStartTLS = false
+	params.ParallelConnect = 0
+	params.FastbindConnections = 0
+	params.PipelinedSearch = false
+	params.Pagesize = 1000
+	params.AdaptivePagesize = false
+	params.RangeParallelism = 0
+	params.DNCacheSize = 0
+	params.DNCacheTTL = 300
+	params.UseTokenGroups = false
 	return
 }
 
@@ -157,6 +175,15 @@ func Login(_params ADConnParams) (err error) {
 	params.SetTimelimit(_params.Timelimit)
 	params.SetUse_tls(_params.UseStartTLS)
 	params.SetUse_ldaps(_params.UseLDAPS)
+	params.SetParallel_connect(_params.ParallelConnect)
+	params.SetFastbind_connections(_params.FastbindConnections)
+	params.SetPipelined_search(_params.PipelinedSearch)
+	params.SetPagesize(_params.Pagesize)
+	params.SetAdaptive_pagesize(_params.AdaptivePagesize)
+	params.SetRange_parallelism(_params.RangeParallelism)
+	params.SetDn_cache_size(_params.DNCacheSize)
+	params.SetDn_cache_ttl(_params.DNCacheTTL)
+	params.SetUse_tokengroups(_params.UseTokenGroups)
 
 	uries := NewStringVector()
 	defer DeleteStringVector(uries)
@@ -221,6 +248,24 @@ func GroupRemoveUser(group string, user string) (err error) {
 	return
 }
 
+func SyncGroupMembers(group string, members []string) (result map[string]string, err error) {
+	result = make(map[string]string)
+	defer catch(&err)
+	cmembers := NewStringVector()
+	defer DeleteStringVector(cmembers)
+	for _, member := range members {
+		cmembers.Add(member)
+	}
+	cmap := ad.SyncGroupMembers(group, cmembers)
+	defer DeleteStringStringMap(cmap)
+	keys := cmap.Keys()
+	for i := 0; i < int(keys.Size()); i++ {
+		key := keys.Get(i)
+		result[key] = cmap.Get(key)
+	}
+	return
+}
+
 func CreateComputer(name string, container string) (err error) {
 	defer catch(&err)
 	ad.CreateComputer(name, container)
@@ -130,6 +130,15 @@ static PyObject *wrapper_login_adclient(PyObject *self, PyObject *args) {
        params.use_ldaps = dict_get_bool(paramsObj, "use_ldaps");
        params.nettimeout = dict_get_int(paramsObj, "nettimeout");
        params.timelimit = dict_get_int(paramsObj, "timelimit");
+       params.parallel_connect = dict_get_int(paramsObj, "parallel_connect");
+       params.fastbind_connections = dict_get_int(paramsObj, "fastbind_connections");
+       params.pipelined_search = dict_get_bool(paramsObj, "pipelined_search");
+       params.pagesize = dict_get_int(paramsObj, "pagesize");
+       params.adaptive_pagesize = dict_get_bool(paramsObj, "adaptive_pagesize");
+       params.range_parallelism = dict_get_int(paramsObj, "range_parallelism");
+       params.dn_cache_size = dict_get_int(paramsObj, "dn_cache_size");
+       params.dn_cache_ttl = dict_get_int(paramsObj, "dn_cache_ttl");
+       params.use_tokengroups = dict_get_bool(paramsObj, "use_tokengroups");
 
        PyObject *key = PyString_FromString("uries");
        if (PyDict_Contains(paramsObj, key) == 1) {